@@ -0,0 +1,95 @@
+// _arena.hpp
+// Monotonic arena for per-document allocations. Memory is bumped out of one
+// retained slab and reset() rewinds to its start, so a long-lived owner that
+// formats document after document stops calling malloc once the slab has grown
+// to fit the largest document seen. Allocations that do not fit go to the heap
+// until the next reset, which then enlarges the slab to the high-water mark.
+// Deallocation is a no-op; everything is freed at once by reset().
+#pragma once
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+class Arena {
+  public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+        size_t pos = (used + align - 1) & ~(align - 1);
+        if (pos + bytes > slab_size) return allocate_spill(bytes, align);
+        used = pos + bytes;
+        return slab.get() + pos;
+    }
+
+    template <typename T> T *allocate_array(size_t n) {
+        static_assert(std::is_trivially_destructible_v<T>);
+        return static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+    }
+
+    // Copies src into the arena.
+    template <typename T> std::span<T> copy(std::span<const T> src) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T *dst = allocate_array<T>(src.size());
+        if (!src.empty()) memcpy(dst, src.data(), src.size_bytes());
+        return {dst, src.size()};
+    }
+
+    // Frees everything allocated since the last reset. If the document spilled
+    // to the heap, the slab is regrown to hold all of it next time.
+    void reset() {
+        size_t high_water = used + spilled;
+        spill_blocks.clear();
+        if (high_water > slab_size) {
+            slab_size = std::bit_ceil(high_water);
+            slab.reset(new std::byte[slab_size]);
+        }
+        used = spilled = 0;
+    }
+
+    size_t capacity() const { return slab_size; }
+
+  private:
+    void *allocate_spill(size_t bytes, size_t align) {
+        size_t space = bytes + align;
+        spilled += space;
+        spill_blocks.emplace_back(new std::byte[space]);
+        void *p = spill_blocks.back().get();
+        return std::align(align, bytes, p, space);
+    }
+
+    std::unique_ptr<std::byte[]> slab;
+    size_t slab_size = 0;
+    size_t used = 0;
+    size_t spilled = 0;
+    std::vector<std::unique_ptr<std::byte[]>> spill_blocks;
+};
+
+// Standard allocator drawing from an Arena, for containers that live no longer
+// than the arena's current document.
+template <typename T> struct ArenaAllocator {
+    using value_type = T;
+
+    Arena *arena;
+
+    ArenaAllocator(Arena &arena) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *, size_t) {}
+
+    template <typename U> bool operator==(const ArenaAllocator<U> &other) const {
+        return arena == other.arena;
+    }
+};
+
+template <typename T> using arena_vector = std::vector<T, ArenaAllocator<T>>;
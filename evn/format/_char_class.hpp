@@ -0,0 +1,166 @@
+// _char_class.hpp
+// Vectorized character classification for the tokenizer. A line is classified
+// 64 bytes at a time into bitmasks (bit k of word w describes byte 64*w + k),
+// so the tokenizer can find token boundaries with bit scans instead of
+// branching per character. SSE2 is the baseline on x86; AVX2 is used when the
+// compiler targets it. Other targets use a table-driven scalar pass.
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define EVN_CHAR_CLASS_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define EVN_CHAR_CLASS_SSE2 1
+#endif
+
+// Classes match the C locale: isspace, isalnum || '_', isdigit, quotes and
+// '#'. high marks bytes >= 0x80, which are part of a multi-byte UTF-8
+// sequence.
+struct CharMaskWord {
+    uint64_t space = 0;
+    uint64_t ident = 0;
+    uint64_t digit = 0;
+    uint64_t quote = 0;
+    uint64_t hash = 0;
+    uint64_t high = 0;
+};
+
+namespace char_class {
+
+enum : uint8_t { SPACE = 1, IDENT = 2, DIGIT = 4, QUOTE = 8, HASH = 16, HIGH = 32 };
+
+constexpr std::array<uint8_t, 256> make_table() {
+    std::array<uint8_t, 256> t{};
+    for (int c = 0; c < 256; ++c) {
+        bool digit = c >= '0' && c <= '9';
+        bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        if (c == ' ' || (c >= '\t' && c <= '\r')) t[c] |= SPACE;
+        if (alpha || digit || c == '_') t[c] |= IDENT;
+        if (digit) t[c] |= DIGIT;
+        if (c == '\'' || c == '"') t[c] |= QUOTE;
+        if (c == '#') t[c] |= HASH;
+        if (c >= 0x80) t[c] |= HIGH;
+    }
+    return t;
+}
+constexpr std::array<uint8_t, 256> table = make_table();
+
+// Classifies 64 bytes starting at p (which must be readable).
+inline CharMaskWord classify64(const char *p) {
+    CharMaskWord w;
+#if defined(EVN_CHAR_CLASS_AVX2)
+    for (int k = 0; k < 64; k += 32) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + k));
+        auto eq = [&](char x) { return _mm256_cmpeq_epi8(c, _mm256_set1_epi8(x)); };
+        auto in = [](__m256i v, char lo, char hi) {
+            return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                                    _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+        };
+        auto bits = [](__m256i m) {
+            return static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(m)));
+        };
+        __m256i digit = in(c, '0', '9');
+        __m256i alpha = in(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 'z');
+        __m256i space = _mm256_or_si256(eq(' '), in(c, '\t', '\r'));
+        __m256i ident = _mm256_or_si256(_mm256_or_si256(digit, alpha), eq('_'));
+        w.space |= bits(space) << k;
+        w.ident |= bits(ident) << k;
+        w.digit |= bits(digit) << k;
+        w.quote |= bits(_mm256_or_si256(eq('\''), eq('"'))) << k;
+        w.hash |= bits(eq('#')) << k;
+        w.high |= bits(c) << k;
+    }
+#elif defined(EVN_CHAR_CLASS_SSE2)
+    for (int k = 0; k < 64; k += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + k));
+        auto eq = [&](char x) { return _mm_cmpeq_epi8(c, _mm_set1_epi8(x)); };
+        auto in = [](__m128i v, char lo, char hi) {
+            return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                                 _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+        };
+        auto bits = [](__m128i m) { return static_cast<uint64_t>(_mm_movemask_epi8(m)); };
+        __m128i digit = in(c, '0', '9');
+        __m128i alpha = in(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 'z');
+        __m128i space = _mm_or_si128(eq(' '), in(c, '\t', '\r'));
+        __m128i ident = _mm_or_si128(_mm_or_si128(digit, alpha), eq('_'));
+        w.space |= bits(space) << k;
+        w.ident |= bits(ident) << k;
+        w.digit |= bits(digit) << k;
+        w.quote |= bits(_mm_or_si128(eq('\''), eq('"'))) << k;
+        w.hash |= bits(eq('#')) << k;
+        w.high |= bits(c) << k;
+    }
+#else
+    for (int k = 0; k < 64; ++k) {
+        uint8_t t = table[static_cast<unsigned char>(p[k])];
+        uint64_t bit = uint64_t(1) << k;
+        if (t & SPACE) w.space |= bit;
+        if (t & IDENT) w.ident |= bit;
+        if (t & DIGIT) w.digit |= bit;
+        if (t & QUOTE) w.quote |= bit;
+        if (t & HASH) w.hash |= bit;
+        if (t & HIGH) w.high |= bit;
+    }
+#endif
+    return w;
+}
+
+} // namespace char_class
+
+// Per-line character class bitmasks. Bytes past the end of the line belong to
+// no class, so run scans stop at the line end.
+class CharMasks {
+  public:
+    using Field = uint64_t CharMaskWord::*;
+
+    void build(std::string_view line) {
+        n = line.size();
+        words.resize((n + 63) / 64);
+        size_t full = n / 64;
+        uint64_t high = 0;
+        for (size_t w = 0; w < full; ++w) {
+            words[w] = char_class::classify64(line.data() + 64 * w);
+            high |= words[w].high;
+        }
+        if (full < words.size()) {
+            char tail[64] = {};
+            memcpy(tail, line.data() + 64 * full, n - 64 * full);
+            words[full] = char_class::classify64(tail);
+            high |= words[full].high;
+        }
+        any_high = high != 0;
+    }
+
+    // True if the line is pure ASCII.
+    bool ascii() const { return !any_high; }
+
+    bool test(Field f, size_t i) const { return (words[i >> 6].*f >> (i & 63)) & 1; }
+
+    // Index of the first byte at or after i that is not in class f (or the
+    // line length if the run reaches the end of the line).
+    size_t run_end(Field f, size_t i) const {
+        size_t w = i >> 6;
+        if (w >= words.size()) return n;
+        uint64_t rest = ~(words[w].*f) >> (i & 63);
+        if (rest) return std::min(n, i + std::countr_zero(rest));
+        for (++w; w < words.size(); ++w) {
+            uint64_t clear = ~(words[w].*f);
+            if (clear) return std::min(n, 64 * w + std::countr_zero(clear));
+        }
+        return n;
+    }
+
+  private:
+    size_t n = 0;
+    bool any_high = false;
+    std::vector<CharMaskWord> words;
+};
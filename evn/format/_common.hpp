@@ -1,19 +1,29 @@
 // format_identifier.cpp
 #include <algorithm>
+#include <array>
 #include <cctype>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <optional>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 // #include <ranges>
 #include <regex>
+#include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "_arena.hpp"
+#include "_char_class.hpp"
+#include "_text_builder.hpp"
+#include "_unicode.hpp"
+
 namespace py = pybind11;
 using namespace std;
 bool debug = false;
@@ -24,6 +34,97 @@ enum class TokenType {
     Numeric,
     Exact // Keywords, punctuation, comments, etc.
 };
+
+// Fine-grained token kind, recorded once by the tokenizer so later stages
+// switch on it instead of re-deriving it from the token text. Operator and
+// delimiter names follow Python's token module.
+enum class TokenKind : uint8_t {
+    Identifier,
+    Keyword,
+    String,
+    Number,
+    Comment,
+    Other, // Any other character, e.g. '$', '?' or a stray backslash.
+    // Operators.
+    Plus, Minus, Star, DoubleStar, Slash, DoubleSlash, Percent, At, LeftShift,
+    RightShift, Amper, Vbar, Circumflex, Tilde, ColonEqual, Less, Greater, LessEqual,
+    GreaterEqual, EqEqual, NotEqual,
+    // Delimiters.
+    LPar, RPar, LSqb, RSqb, LBrace, RBrace, Comma, Colon, Dot, Semi, Equal, RArrow,
+    Ellipsis, Exclamation, PlusEqual, MinusEqual, StarEqual, SlashEqual,
+    DoubleSlashEqual, PercentEqual, AtEqual, AmperEqual, VbarEqual, CircumflexEqual,
+    RightShiftEqual, LeftShiftEqual, DoubleStarEqual,
+    NumKinds
+};
+constexpr size_t num_token_kinds = static_cast<size_t>(TokenKind::NumKinds);
+
+// The wildcard class used for pattern matching.
+constexpr TokenType token_type(TokenKind kind) {
+    switch (kind) {
+    case TokenKind::Identifier: return TokenType::Identifier;
+    case TokenKind::String:     return TokenType::String;
+    case TokenKind::Number:     return TokenType::Numeric;
+    default:                    return TokenType::Exact;
+    }
+}
+
+constexpr bool is_opener(TokenKind kind) {
+    return kind == TokenKind::LPar || kind == TokenKind::LSqb ||
+           kind == TokenKind::LBrace;
+}
+
+constexpr bool is_closer(TokenKind kind) {
+    return kind == TokenKind::RPar || kind == TokenKind::RSqb ||
+           kind == TokenKind::RBrace;
+}
+
+// Operators that are spaced like binary operators; ',', ':', brackets, '.',
+// '@' (decorators) and '...' are not.
+constexpr bool is_spaced_operator(TokenKind kind) {
+    switch (kind) {
+    case TokenKind::Plus:
+    case TokenKind::Minus:
+    case TokenKind::Star:
+    case TokenKind::DoubleStar:
+    case TokenKind::Slash:
+    case TokenKind::DoubleSlash:
+    case TokenKind::Percent:
+    case TokenKind::LeftShift:
+    case TokenKind::RightShift:
+    case TokenKind::Amper:
+    case TokenKind::Vbar:
+    case TokenKind::Circumflex:
+    case TokenKind::Tilde:
+    case TokenKind::ColonEqual:
+    case TokenKind::Less:
+    case TokenKind::Greater:
+    case TokenKind::LessEqual:
+    case TokenKind::GreaterEqual:
+    case TokenKind::EqEqual:
+    case TokenKind::NotEqual:
+    case TokenKind::Equal:
+    case TokenKind::RArrow:
+    case TokenKind::PlusEqual:
+    case TokenKind::MinusEqual:
+    case TokenKind::StarEqual:
+    case TokenKind::SlashEqual:
+    case TokenKind::DoubleSlashEqual:
+    case TokenKind::PercentEqual:
+    case TokenKind::AtEqual:
+    case TokenKind::AmperEqual:
+    case TokenKind::VbarEqual:
+    case TokenKind::CircumflexEqual:
+    case TokenKind::RightShiftEqual:
+    case TokenKind::LeftShiftEqual:
+    case TokenKind::DoubleStarEqual: return true;
+    default:                         return false;
+    }
+}
+
+constexpr bool is_identifier_or_literal(TokenKind kind) {
+    return kind == TokenKind::Identifier || kind == TokenKind::String ||
+           kind == TokenKind::Number;
+}
 // Get indentation level of a line
 string get_indentation(string const &line) {
     auto nonWhitespace = line.find_first_not_of(" \t");
@@ -51,41 +152,211 @@ bool is_multiline(string const &line) {
     return line[i] == '\\';
 }
 
-bool is_opener(const string &token) {
-    return token == "(" || token == "[" || token == "{";
+struct OperatorSpelling {
+    string_view text;
+    TokenKind kind;
+};
+
+// Python operators and delimiters, recognized by longest match.
+constexpr OperatorSpelling python_operators[] = {
+    {"+", TokenKind::Plus},
+    {"-", TokenKind::Minus},
+    {"*", TokenKind::Star},
+    {"**", TokenKind::DoubleStar},
+    {"/", TokenKind::Slash},
+    {"//", TokenKind::DoubleSlash},
+    {"%", TokenKind::Percent},
+    {"@", TokenKind::At},
+    {"<<", TokenKind::LeftShift},
+    {">>", TokenKind::RightShift},
+    {"&", TokenKind::Amper},
+    {"|", TokenKind::Vbar},
+    {"^", TokenKind::Circumflex},
+    {"~", TokenKind::Tilde},
+    {":=", TokenKind::ColonEqual},
+    {"<", TokenKind::Less},
+    {">", TokenKind::Greater},
+    {"<=", TokenKind::LessEqual},
+    {">=", TokenKind::GreaterEqual},
+    {"==", TokenKind::EqEqual},
+    {"!=", TokenKind::NotEqual},
+    {"(", TokenKind::LPar},
+    {")", TokenKind::RPar},
+    {"[", TokenKind::LSqb},
+    {"]", TokenKind::RSqb},
+    {"{", TokenKind::LBrace},
+    {"}", TokenKind::RBrace},
+    {",", TokenKind::Comma},
+    {":", TokenKind::Colon},
+    {".", TokenKind::Dot},
+    {";", TokenKind::Semi},
+    {"=", TokenKind::Equal},
+    {"->", TokenKind::RArrow},
+    {"...", TokenKind::Ellipsis},
+    {"!", TokenKind::Exclamation},
+    {"+=", TokenKind::PlusEqual},
+    {"-=", TokenKind::MinusEqual},
+    {"*=", TokenKind::StarEqual},
+    {"/=", TokenKind::SlashEqual},
+    {"//=", TokenKind::DoubleSlashEqual},
+    {"%=", TokenKind::PercentEqual},
+    {"@=", TokenKind::AtEqual},
+    {"&=", TokenKind::AmperEqual},
+    {"|=", TokenKind::VbarEqual},
+    {"^=", TokenKind::CircumflexEqual},
+    {">>=", TokenKind::RightShiftEqual},
+    {"<<=", TokenKind::LeftShiftEqual},
+    {"**=", TokenKind::DoubleStarEqual}};
+
+// Deterministic automaton over python_operators, generated at compile time.
+// State 0 is the start state and doubles as the dead state for transitions.
+// Input bytes are first mapped to a dense index of the characters that occur
+// in operators so the transition table stays small.
+struct OperatorDfa {
+    static constexpr int max_states = 64;
+    static constexpr int max_chars = 32;
+    uint8_t char_index[256] = {}; // 0: byte cannot occur in an operator
+    uint8_t next[max_states][max_chars] = {};
+    bool accept[max_states] = {};
+    TokenKind kind[max_states] = {}; // operator recognized in an accepting state
+    int num_states = 1;
+    int num_chars = 1;
+};
+
+constexpr OperatorDfa build_operator_dfa() {
+    OperatorDfa dfa;
+    for (const auto &op : python_operators) {
+        int state = 0;
+        for (char ch : op.text) {
+            auto c = static_cast<unsigned char>(ch);
+            if (!dfa.char_index[c]) dfa.char_index[c] = dfa.num_chars++;
+            uint8_t &next = dfa.next[state][dfa.char_index[c]];
+            if (!next) next = dfa.num_states++;
+            state = next;
+        }
+        dfa.accept[state] = true;
+        dfa.kind[state] = op.kind;
+    }
+    return dfa;
+}
+
+constexpr OperatorDfa operator_dfa = build_operator_dfa();
+static_assert(operator_dfa.num_states <= OperatorDfa::max_states);
+static_assert(operator_dfa.num_chars <= OperatorDfa::max_chars);
+
+// Returns the length of the longest operator starting at line[i], or 0, and
+// stores its kind in kind.
+size_t match_operator(string_view line, size_t i, TokenKind &kind) {
+    size_t best = 0;
+    int state = 0;
+    for (size_t j = i; j < line.size(); ++j) {
+        uint8_t c = operator_dfa.char_index[static_cast<unsigned char>(line[j])];
+        state = c ? operator_dfa.next[state][c] : 0;
+        if (!state) break;
+        if (operator_dfa.accept[state]) {
+            best = j - i + 1;
+            kind = operator_dfa.kind[state];
+        }
+    }
+    return best;
+}
+
+// Returns the DFA state reached by consuming all of token, or 0.
+int operator_state(string_view token) {
+    int state = 0;
+    for (char ch : token) {
+        uint8_t c = operator_dfa.char_index[static_cast<unsigned char>(ch)];
+        state = c ? operator_dfa.next[state][c] : 0;
+        if (!state) return 0;
+    }
+    return state;
+}
+
+bool is_operator(string_view token) {
+    int state = operator_state(token);
+    return operator_dfa.accept[state] && is_spaced_operator(operator_dfa.kind[state]);
+}
+
+// Soft keywords are only keywords in some contexts (match statements, type
+// aliases) and are otherwise ordinary identifiers.
+enum class KeywordClass : uint8_t { None, Hard, Soft };
+
+struct KeywordEntry {
+    string_view word;
+    KeywordClass cls = KeywordClass::None;
+};
+
+constexpr KeywordEntry python_keywords[] = {
+    {"False", KeywordClass::Hard},    {"None", KeywordClass::Hard},
+    {"True", KeywordClass::Hard},     {"and", KeywordClass::Hard},
+    {"as", KeywordClass::Hard},       {"assert", KeywordClass::Hard},
+    {"async", KeywordClass::Hard},    {"await", KeywordClass::Hard},
+    {"break", KeywordClass::Hard},    {"class", KeywordClass::Hard},
+    {"continue", KeywordClass::Hard}, {"def", KeywordClass::Hard},
+    {"del", KeywordClass::Hard},      {"elif", KeywordClass::Hard},
+    {"else", KeywordClass::Hard},     {"except", KeywordClass::Hard},
+    {"finally", KeywordClass::Hard},  {"for", KeywordClass::Hard},
+    {"from", KeywordClass::Hard},     {"global", KeywordClass::Hard},
+    {"if", KeywordClass::Hard},       {"import", KeywordClass::Hard},
+    {"in", KeywordClass::Hard},       {"is", KeywordClass::Hard},
+    {"lambda", KeywordClass::Hard},   {"nonlocal", KeywordClass::Hard},
+    {"not", KeywordClass::Hard},      {"or", KeywordClass::Hard},
+    {"pass", KeywordClass::Hard},     {"raise", KeywordClass::Hard},
+    {"return", KeywordClass::Hard},   {"try", KeywordClass::Hard},
+    {"while", KeywordClass::Hard},    {"with", KeywordClass::Hard},
+    {"yield", KeywordClass::Hard},    {"match", KeywordClass::Soft},
+    {"case", KeywordClass::Soft},     {"type", KeywordClass::Soft},
+    {"_", KeywordClass::Soft}};
+
+// Perfect hash over python_keywords using the length and the first and last
+// bytes; collision freedom is checked when the table is built.
+constexpr size_t keyword_slots = 128;
+constexpr size_t max_keyword_length = 8;
+constexpr size_t keyword_hash(string_view word) {
+    return (word.size() * 11 + static_cast<unsigned char>(word.front()) +
+            static_cast<unsigned char>(word.back()) * 28) %
+           keyword_slots;
 }
 
-bool is_closer(const string &token) {
-    return token == ")" || token == "]" || token == "}";
+struct KeywordTable {
+    KeywordEntry slots[keyword_slots] = {};
+    bool perfect = true;
+};
+
+constexpr KeywordTable build_keyword_table() {
+    KeywordTable table;
+    for (const auto &entry : python_keywords) {
+        KeywordEntry &slot = table.slots[keyword_hash(entry.word)];
+        if (!slot.word.empty() || entry.word.size() > max_keyword_length)
+            table.perfect = false;
+        slot = entry;
+    }
+    return table;
 }
 
-bool is_operator(const string &token) {
-    static const unordered_set<string> operators = {
-        "+", "-",  "*",  "/",  "%",  "**", "//", "==", "!=", "<", ">",  "<=", ">=",
-        "=", "->", "+=", "-=", "*=", "/=", "%=", "&",  "|",  "^", ">>", "<<", "~"};
-    return operators.find(token) != operators.end();
+constexpr KeywordTable keyword_table = build_keyword_table();
+static_assert(keyword_table.perfect, "keyword_hash must be collision free");
+
+KeywordClass keyword_class(string_view token) {
+    if (token.empty() || token.size() > max_keyword_length) return KeywordClass::None;
+    const KeywordEntry &slot = keyword_table.slots[keyword_hash(token)];
+    return slot.word == token ? slot.cls : KeywordClass::None;
 }
 
-bool is_keyword(const string &token) {
-    static const unordered_set<string> python_keywords = {
-        "False",  "None",   "True",    "and",      "as",       "assert", "async",
-        "await",  "break",  "class",   "continue", "def",      "del",    "elif",
-        "else",   "except", "finally", "for",      "from",     "global", "if",
-        "import", "in",     "is",      "lambda",   "nonlocal", "not",    "or",
-        "pass",   "raise",  "return",  "try",      "while",    "with",   "yield"};
-    return python_keywords.find(token) != python_keywords.end();
+bool is_keyword(string_view token) { return keyword_class(token) == KeywordClass::Hard; }
+
+bool is_soft_keyword(string_view token) {
+    return keyword_class(token) == KeywordClass::Soft;
 }
 
-string rstrip(const string &str) {
-    string trimmed_str = str;
-    auto it = find_if(trimmed_str.rbegin(), trimmed_str.rend(),
-                      [](unsigned char ch) { return !isspace(ch); });
-    trimmed_str.erase(it.base(), trimmed_str.end());
-    return trimmed_str;
+string_view rstrip(string_view str) {
+    auto it =
+        find_if(str.rbegin(), str.rend(), [](unsigned char ch) { return !isspace(ch); });
+    return str.substr(0, str.rend() - it);
 }
 
 // Helper functions for token type checking.
-bool is_string_literal(const string &token) {
+bool is_string_literal(string_view token) {
     if (token.empty()) return false;
     if (token.at(0) == '\'' || token.at(0) == '"') return true;
     if (token.size() >= 2 && (token.at(0) == 'f' || token.at(0) == 'F') &&
@@ -94,31 +365,43 @@ bool is_string_literal(const string &token) {
     return false;
 }
 
-bool is_identifier(const string &token) {
+// Identifiers are UTF-8; non-ASCII characters follow PEP 3131 (e.g. 'Δt').
+bool is_identifier(string_view token) {
     if (token.empty()) return false;
-    if (!isalpha(static_cast<unsigned char>(token.at(0))) && token.at(0) != '_')
-        return false;
-    for (size_t i = 1; i < token.size(); i++) {
-        if (!isalnum(static_cast<unsigned char>(token.at(i))) && token.at(i) != '_')
-            return false;
+    size_t len;
+    for (size_t i = 0; i < token.size(); i += len) {
+        char32_t cp = utf8_decode(token, i, len);
+        if (!(i == 0 ? is_xid_start(cp) : is_xid_continue(cp))) return false;
     }
     return true;
 }
-TokenType get_token_type(const string &token) {
+// Numbers start with a digit, or with '.' when a fraction follows ('.5').
+bool is_numeric_literal(string_view token) {
+    if (token.empty()) return false;
+    size_t i = token[0] == '.' ? 1 : 0;
+    return i < token.size() && isdigit(static_cast<unsigned char>(token[i]));
+}
+
+TokenType get_token_type(string_view token) {
     if (is_string_literal(token)) return TokenType::String;
     if (is_identifier(token)) {
         if (is_keyword(token)) return TokenType::Exact;
         return TokenType::Identifier;
     }
-    if (!token.empty() && isdigit(static_cast<unsigned char>(token.at(0))))
-        return TokenType::Numeric;
+    if (is_numeric_literal(token)) return TokenType::Numeric;
     return TokenType::Exact;
 }
 
-bool is_identifier_or_literal(const string &token) {
-    TokenType t = get_token_type(token);
-    return (t == TokenType::Identifier || t == TokenType::String ||
-            t == TokenType::Numeric);
+// Classifies a standalone token, for callers that pass token text rather
+// than tokenizer output.
+TokenKind classify_token(string_view token) {
+    if (is_string_literal(token)) return TokenKind::String;
+    if (is_identifier(token))
+        return is_keyword(token) ? TokenKind::Keyword : TokenKind::Identifier;
+    if (is_numeric_literal(token)) return TokenKind::Number;
+    if (!token.empty() && token[0] == '#') return TokenKind::Comment;
+    int state = operator_state(token);
+    return operator_dfa.accept[state] ? operator_dfa.kind[state] : TokenKind::Other;
 }
 
 bool is_oneline_statement_string(string const &line) {
@@ -202,11 +485,12 @@ bool is_oneline_statement_string(string const &line) {
     return true;
 }
 
-bool is_oneline_statement(vector<string> const &tokens) {
+template <typename Str> bool is_oneline_statement(vector<Str> const &tokens) {
     if (tokens.empty()) return false;
-    static const vector<string> keywords = {"if",    "elif", "else",  "for",
-                                            "while", "def",  "class", "with"};
-    if (find(keywords.begin(), keywords.end(), tokens[0]) == keywords.end()) return false;
+    static const vector<string_view> keywords = {"if",    "elif", "else",  "for",
+                                                 "while", "def",  "class", "with"};
+    if (find(keywords.begin(), keywords.end(), string_view(tokens[0])) == keywords.end())
+        return false;
     for (int i = 1; i < tokens.size(); ++i)
         if (tokens[i] == ":") {
             if (i == tokens.size() - 1) return false;
@@ -216,149 +500,452 @@ bool is_oneline_statement(vector<string> const &tokens) {
     return false;
 }
 
-// Delimiter helper: returns the delimiter to insert before the current
-// token.
-string delimiter(size_t prev_index, size_t curr_index, const vector<string> &tokens,
-                 bool in_param_context, int depth) {
-    const string &prev = tokens.at(prev_index);
-    const string &next = tokens.at(curr_index);
-    if (in_param_context && (prev == "=" || next == "=")) return "";
-    if (is_operator(prev) || is_operator(next)) {
-        if (depth > 1 && (prev == "+" || prev == "-" || next == "+" || next == "-"))
-            return "";
-        return " ";
+// Context bits for the spacing between two tokens.
+enum DelimiterContext : unsigned {
+    InParams = 1, // Parameters of a def or lambda, where '=' is not spaced.
+    Nested = 2,   // Inside nested brackets, where '+' and '-' are not spaced.
+    NumDelimiterContexts = 4
+};
+
+// Whether a space goes between tokens of kind prev and next in context.
+constexpr bool is_spaced(TokenKind prev, TokenKind next, unsigned context) {
+    if ((context & InParams) && (prev == TokenKind::Equal || next == TokenKind::Equal))
+        return false;
+    if (is_spaced_operator(prev) || is_spaced_operator(next)) {
+        auto sign = [](TokenKind k) {
+            return k == TokenKind::Plus || k == TokenKind::Minus;
+        };
+        return !((context & Nested) && (sign(prev) || sign(next)));
     }
-    if (is_opener(prev)) return "";
-    if (is_closer(next)) return "";
-    if (next == "," || next == ":" || next == ";") return "";
-    if (next == "(" && is_identifier_or_literal(prev) && !is_keyword(prev)) return "";
-    return " ";
+    if (is_opener(prev)) return false;
+    if (is_closer(next)) return false;
+    if (next == TokenKind::Comma || next == TokenKind::Colon || next == TokenKind::Semi)
+        return false;
+    if (next == TokenKind::LPar && is_identifier_or_literal(prev)) return false;
+    return true;
 }
 
-// Parses a string literal from the given line starting at index i.
-string parse_string_literal(const string &line, size_t &i, bool is_f_string) {
-    size_t start = i;
+// is_spaced for every context and pair of kinds, worked out at compile time.
+constexpr auto spacing_table = [] {
+    array<array<array<bool, num_token_kinds>, num_token_kinds>, NumDelimiterContexts>
+        table{};
+    for (unsigned c = 0; c < NumDelimiterContexts; c++)
+        for (size_t p = 0; p < num_token_kinds; p++)
+            for (size_t n = 0; n < num_token_kinds; n++)
+                table[c][p][n] = is_spaced(static_cast<TokenKind>(p),
+                                           static_cast<TokenKind>(n), c);
+    return table;
+}();
+
+// Delimiter helper: returns the delimiter to insert between tokens of kind
+// prev and next, looked up in spacing_table.
+string_view delimiter(TokenKind prev, TokenKind next, bool in_param_context, int depth) {
+    unsigned context = (in_param_context ? unsigned(InParams) : 0u) |
+                       (depth > 1 ? unsigned(Nested) : 0u);
+    const auto &row = spacing_table[context][static_cast<size_t>(prev)];
+    return {" ", row[static_cast<size_t>(next)]};
+}
+
+// A token is a span into the line it was lexed from; the text is only
+// materialized when output is written.
+struct Token {
+    uint32_t offset;
+    uint32_t length;
+    TokenKind kind;
+    string_view text(string_view line) const { return line.substr(offset, length); }
+    TokenType type() const { return token_type(kind); }
+};
+
+// Kind-based counterpart of is_oneline_statement for tokenizer output.
+bool is_oneline_statement(string_view line, span<const Token> tokens) {
+    if (tokens.empty() || tokens[0].kind != TokenKind::Keyword) return false;
+    static const vector<string_view> keywords = {"if",    "elif", "else",  "for",
+                                                 "while", "def",  "class", "with"};
+    if (find(keywords.begin(), keywords.end(), tokens[0].text(line)) == keywords.end())
+        return false;
+    for (size_t i = 1; i < tokens.size(); ++i)
+        if (tokens[i].kind == TokenKind::Colon)
+            return i + 1 < tokens.size() && tokens[i + 1].kind != TokenKind::Comment;
+    return false;
+}
+
+// Lexer state carried from one physical line to the next.
+struct LexState {
+    char quote = 0;      // Delimiter of a string left open, or 0.
+    bool triple = false; // Whether the open string is triple quoted.
+
+    bool in_string() const { return quote != 0; }
+};
+
+// Scans the body of a string literal delimited by quote, starting at index i
+// (just past the opening delimiter). Returns the index one past the closing
+// delimiter, or the line length if the string is still open at the end of
+// the line. Candidate quotes are located with find rather than by stepping
+// through every byte; a quote preceded by an odd run of backslashes is
+// escaped.
+size_t scan_string_body(string_view line, size_t i, char quote, bool triple,
+                        bool &closed) {
+    size_t body = i;
+    closed = false;
+    while ((i = line.find(quote, i)) != string_view::npos) {
+        size_t backslashes = 0;
+        while (i - backslashes > body && line[i - backslashes - 1] == '\\') ++backslashes;
+        bool closes = !triple || (i + 2 < line.size() && line[i + 1] == quote &&
+                                  line[i + 2] == quote);
+        if (backslashes % 2 == 0 && closes) {
+            closed = true;
+            return i + (triple ? 3 : 1);
+        }
+        ++i;
+    }
+    return line.size();
+}
+
+// Scans a string literal in line starting at index i and returns the index
+// one past its end (clamped to the line length). If open is given, a string
+// left unterminated at the end of the line is recorded in it.
+size_t scan_string_literal(string_view line, size_t i, bool is_f_string,
+                           LexState *open = nullptr) {
     if (is_f_string) ++i; // skip the 'f' or 'F'
     if (i >= line.size()) throw out_of_range("String literal start index out of range");
-    char quote = line.at(i);
+    char quote = line[i];
     bool triple = false;
-    if (i + 2 < line.size() && line.at(i) == line.at(i + 1) &&
-        line.at(i) == line.at(i + 2)) {
+    if (i + 2 < line.size() && line[i] == line[i + 1] && line[i] == line[i + 2]) {
         triple = true;
         i += 3;
     } else {
         ++i;
     }
-    while (i < line.size()) {
-        if (line.at(i) == '\\') {
-            i += 2;
-        } else if (triple) {
-            if (i + 2 < line.size() && line.at(i) == quote && line.at(i + 1) == quote &&
-                line.at(i + 2) == quote) {
-                i += 3;
-                break;
-            } else {
-                ++i;
-            }
-        } else {
-            if (line.at(i) == quote) {
-                ++i;
-                break;
-            } else {
-                ++i;
-            }
+    bool closed;
+    i = scan_string_body(line, i, quote, triple, closed);
+    // An unterminated single-quoted string only continues onto the next
+    // line after a backslash.
+    if (open && !closed && (triple || line.back() == '\\')) {
+        open->quote = quote;
+        open->triple = triple;
+    }
+    return i;
+}
+
+// Digit classes of the numeric literal lexer, one bit per radix.
+namespace number_digit {
+
+enum : uint8_t { DEC = 1, HEX = 2, OCT = 4, BIN = 8 };
+
+constexpr array<uint8_t, 256> make_table() {
+    array<uint8_t, 256> t{};
+    for (int c = '0'; c <= '9'; ++c) t[c] = DEC | HEX | (c <= '7' ? OCT : 0);
+    t['0'] |= BIN;
+    t['1'] |= BIN;
+    for (int c = 0; c < 6; ++c) t['a' + c] = t['A' + c] = HEX;
+    return t;
+}
+constexpr array<uint8_t, 256> table = make_table();
+
+} // namespace number_digit
+
+// Scans digits of the given class, allowing single '_' separators between
+// digits. Returns i if line[i] is not such a digit.
+inline size_t scan_digit_part(string_view line, size_t i, uint8_t digit_class) {
+    auto is_digit = [&](size_t k) {
+        return k < line.size() &&
+               (number_digit::table[static_cast<unsigned char>(line[k])] & digit_class);
+    };
+    if (!is_digit(i)) return i;
+    for (++i; i < line.size(); ++i) {
+        if (is_digit(i)) continue;
+        if (line[i] != '_' || !is_digit(i + 1)) break;
+        ++i;
+    }
+    return i;
+}
+
+// Returns the end of the numeric literal starting at line[i], which is a
+// digit or a '.' followed by a digit. Accepts the Python forms: hex, octal
+// and binary integers, '_' separators, fractions, exponents and the 'j'
+// imaginary suffix. A sign belongs to the literal only directly after the
+// exponent marker, so "1-2" is three tokens. A malformed tail such as "1_"
+// or "0x" ends the literal at its last valid character.
+size_t scan_number(string_view line, size_t i) {
+    auto lower = [&](size_t k) { return k < line.size() ? line[k] | 0x20 : 0; };
+    if (line[i] == '0') {
+        char prefix = lower(i + 1);
+        uint8_t radix = prefix == 'x'   ? number_digit::HEX
+                        : prefix == 'o' ? number_digit::OCT
+                        : prefix == 'b' ? number_digit::BIN
+                                        : 0;
+        if (radix) {
+            size_t j = i + 2;
+            if (j < line.size() && line[j] == '_') ++j;
+            size_t end = scan_digit_part(line, j, radix);
+            return end > j ? end : i + 1;
         }
     }
-    return line.substr(start, i - start);
+    size_t end = scan_digit_part(line, i, number_digit::DEC);
+    if (end < line.size() && line[end] == '.') {
+        size_t frac = scan_digit_part(line, end + 1, number_digit::DEC);
+        if (end > i || frac > end + 1) end = frac;
+    }
+    if (lower(end) == 'e') {
+        size_t j = end + 1;
+        if (j < line.size() && (line[j] == '+' || line[j] == '-')) ++j;
+        size_t exp = scan_digit_part(line, j, number_digit::DEC);
+        if (exp > j) end = exp;
+    }
+    if (lower(end) == 'j') ++end;
+    return end;
 }
 
-// Tokenizes a single line of Python code.
-vector<string> tokenize(const string &line) {
-    vector<string> tokens;
-    size_t i = 0;
-    while (i < line.size()) {
+// Returns the end of the identifier continuing at line[i]. ASCII runs are
+// taken from the masks; code points are only decoded at non-ASCII bytes.
+size_t scan_identifier(string_view line, size_t i, const CharMasks &masks) {
+    i = masks.run_end(&CharMaskWord::ident, i);
+    if (masks.ascii()) return i;
+    while (i < line.size() && masks.test(&CharMaskWord::high, i)) {
+        size_t len;
+        if (!is_xid_continue(utf8_decode(line, i, len))) break;
+        i = masks.run_end(&CharMaskWord::ident, i + len);
+    }
+    return i;
+}
+
+// Tokenizes line from index i into spans over line. Tokens are appended to
+// tokens, which is not cleared. Character classes are computed for the whole
+// line up front so runs of whitespace, identifier characters and digits are
+// skipped with bit scans. A string left open at the end of the line is
+// recorded in open.
+void tokenize_spans(string_view line, vector<Token> &tokens, size_t i = 0,
+                    LexState *open = nullptr) {
+    thread_local CharMasks masks;
+    masks.build(line);
+    auto emit = [&](size_t start, size_t end, TokenKind kind) {
+        tokens.push_back(
+            {static_cast<uint32_t>(start), static_cast<uint32_t>(end - start), kind});
+    };
+    while (true) {
         // Skip whitespace.
-        if (isspace(static_cast<unsigned char>(line.at(i)))) {
-            ++i;
-            continue;
-        }
+        i = masks.run_end(&CharMaskWord::space, i);
+        if (i >= line.size()) break;
         // Handle comments: rest of the line is one token.
-        if (line.at(i) == '#') {
-            tokens.push_back(line.substr(i));
+        if (masks.test(&CharMaskWord::hash, i)) {
+            emit(i, line.size(), TokenKind::Comment);
             break;
         }
-        // Check for an f-string literal.
-        if ((line.at(i) == 'f' || line.at(i) == 'F') && (i + 1 < line.size()) &&
-            (line.at(i + 1) == '\'' || line.at(i + 1) == '"')) {
-            tokens.push_back(parse_string_literal(line, i, true));
+        if (masks.test(&CharMaskWord::ident, i)) {
+            size_t start = i;
+            // Check for an f-string literal.
+            if ((line[i] == 'f' || line[i] == 'F') && i + 1 < line.size() &&
+                masks.test(&CharMaskWord::quote, i + 1)) {
+                i = scan_string_literal(line, i, true, open);
+                emit(start, i, TokenKind::String);
+                continue;
+            }
+            if (masks.test(&CharMaskWord::digit, i)) {
+                i = scan_number(line, i);
+                emit(start, i, TokenKind::Number);
+                continue;
+            }
+            // Identifier or keyword.
+            i = scan_identifier(line, i, masks);
+            bool kw = is_keyword(line.substr(start, i - start));
+            emit(start, i, kw ? TokenKind::Keyword : TokenKind::Identifier);
             continue;
         }
         // Check for a normal string literal.
-        if (line.at(i) == '\'' || line.at(i) == '"') {
-            tokens.push_back(parse_string_literal(line, i, false));
+        if (masks.test(&CharMaskWord::quote, i)) {
+            size_t start = i;
+            i = scan_string_literal(line, i, false, open);
+            emit(start, i, TokenKind::String);
             continue;
         }
-        // Check for an identifier or keyword.
-        if (isalpha(static_cast<unsigned char>(line.at(i))) || line.at(i) == '_') {
-            size_t start = i;
-            while (i < line.size() && (isalnum(static_cast<unsigned char>(line.at(i))) ||
-                                       line.at(i) == '_')) {
-                ++i;
-            }
-            tokens.push_back(line.substr(start, i - start));
+        // Non-ASCII: an identifier if the code point can start one, otherwise
+        // the whole character is a single Other token.
+        if (!masks.ascii() && masks.test(&CharMaskWord::high, i)) {
+            size_t start = i, len;
+            bool ident = is_xid_start(utf8_decode(line, i, len));
+            i = ident ? scan_identifier(line, i + len, masks) : i + len;
+            emit(start, i, ident ? TokenKind::Identifier : TokenKind::Other);
             continue;
         }
-        // Handle numeric literals in a basic way.
-        if (isdigit(static_cast<unsigned char>(line.at(i)))) {
+        // Fractions without a leading digit ('.5').
+        if (line[i] == '.' && i + 1 < line.size() &&
+            masks.test(&CharMaskWord::digit, i + 1)) {
             size_t start = i;
-            while (i < line.size() &&
-                   (isdigit(static_cast<unsigned char>(line.at(i))) ||
-                    line.at(i) == '.' || line.at(i) == 'e' || line.at(i) == 'E' ||
-                    line.at(i) == '+' || line.at(i) == '-')) {
-                ++i;
-            }
-            tokens.push_back(line.substr(start, i - start));
+            i = scan_number(line, i);
+            emit(start, i, TokenKind::Number);
             continue;
         }
-        // Check for multi-character punctuation/operators.
-        bool multi_matched = false;
-        static const vector<string> multi_tokens = {"...", "==", "!=", "<=", ">=", "//",
-                                                    "**",  "->", "+=", "-=", "*=", "/=",
-                                                    "%=",  "&=", "|=", "^=", ">>", "<<"};
-        for (const auto &tok : multi_tokens) {
-            if (line.compare(i, tok.size(), tok) == 0) {
-                tokens.push_back(tok);
-                i += tok.size();
-                multi_matched = true;
-                break;
-            }
+        // Punctuation and operators: longest match through the operator DFA.
+        TokenKind kind = TokenKind::Other;
+        size_t len = max<size_t>(1, match_operator(line, i, kind));
+        emit(i, i + len, kind);
+        i += len;
+    }
+}
+
+// Tokenizes one physical line of a document, continuing from the lexer state
+// left by the previous line and updating it for the next one. A line that
+// starts inside a multi-line string is only searched for the closing
+// delimiter; if there is none, the line produces no tokens and the character
+// classes are never computed.
+void tokenize_line(string_view line, LexState &state, vector<Token> &tokens) {
+    size_t i = 0;
+    if (state.in_string()) {
+        bool closed;
+        i = scan_string_body(line, 0, state.quote, state.triple, closed);
+        if (!closed) {
+            if (!state.triple && (line.empty() || line.back() != '\\')) state.quote = 0;
+            return;
         }
-        if (multi_matched) continue;
-        // Single-character punctuation.
-        try {
-            tokens.push_back(string(1, line.at(i)));
-        } catch (const out_of_range &e) {
-            throw runtime_error("Index error in tokenize at position " + to_string(i));
+        tokens.push_back({0, static_cast<uint32_t>(i), TokenKind::String});
+        state.quote = 0;
+    }
+    tokenize_spans(line, tokens, i, &state);
+}
+
+// Advances state over line as tokenize_line would, but without tokenizing: no
+// other token can contain a quote or '#', so following string literals and
+// comments is enough to know whether the next line starts inside a string.
+void skip_line(string_view line, LexState &state) {
+    size_t i = 0;
+    if (state.in_string()) {
+        bool closed;
+        i = scan_string_body(line, 0, state.quote, state.triple, closed);
+        if (!closed) {
+            if (!state.triple && (line.empty() || line.back() != '\\')) state.quote = 0;
+            return;
         }
-        ++i;
+        state.quote = 0;
+    }
+    while ((i = line.find_first_of("'\"#", i)) != string_view::npos) {
+        if (line[i] == '#') return;
+        i = scan_string_literal(line, i, false, &state);
     }
+}
+
+// Tokenizes a single line of Python code.
+vector<string> tokenize(const string &line) {
+    vector<Token> spans;
+    tokenize_spans(line, spans);
+    vector<string> tokens;
+    tokens.reserve(spans.size());
+    for (const auto &tok : spans) tokens.emplace_back(tok.text(line));
     return tokens;
 }
 
-// Returns a token pattern for grouping.
-vector<string> get_token_pattern(const vector<string> &tokens) {
-    vector<string> pattern;
-    for (const auto &tok : tokens) {
-        if (is_string_literal(tok))
-            pattern.push_back("STR");
-        else if (is_identifier(tok) && !is_keyword(tok))
-            pattern.push_back("ID");
-        else if (!tok.empty() && isdigit(static_cast<unsigned char>(tok.at(0))))
-            pattern.push_back("NUM");
-        else
-            pattern.push_back(tok);
+// Splits a buffer into views of its lines, with the same semantics as
+// repeated getline: no trailing empty line after a final newline.
+template <typename Alloc = allocator<string_view>>
+vector<string_view, Alloc> split_lines(string_view code, const Alloc &alloc = Alloc()) {
+    vector<string_view, Alloc> lines(alloc);
+    size_t pos = 0;
+    while (pos < code.size()) {
+        size_t nl = code.find('\n', pos);
+        if (nl == string_view::npos) {
+            lines.push_back(code.substr(pos));
+            break;
+        }
+        lines.push_back(code.substr(pos, nl - pos));
+        pos = nl + 1;
     }
-    return pattern;
+    return lines;
+}
+
+// Tokens of a whole buffer as flat columns, one entry per token: byte offset
+// from the start of the buffer, byte length, TokenKind and zero-based line
+// number. A string literal spanning several lines contributes a token on
+// the line where it opens and on the line where it closes; lines entirely
+// inside it contribute none.
+struct TokenBuffer {
+    vector<uint64_t> start;
+    vector<uint32_t> length;
+    vector<uint8_t> kind;
+    vector<uint32_t> line;
+
+    size_t size() const { return start.size(); }
+};
+
+TokenBuffer tokenize_buffer(string_view code) {
+    TokenBuffer result;
+    vector<Token> tokens;
+    LexState state;
+    uint32_t lineno = 0;
+    for (string_view line : split_lines(code)) {
+        tokens.clear();
+        tokenize_line(line, state, tokens);
+        uint64_t line_start = line.data() - code.data();
+        for (const auto &tok : tokens) {
+            result.start.push_back(line_start + tok.offset);
+            result.length.push_back(tok.length);
+            result.kind.push_back(static_cast<uint8_t>(tok.kind));
+            result.line.push_back(lineno);
+        }
+        ++lineno;
+    }
+    return result;
+}
+
+// Per-document symbol table mapping tokens to 32-bit pattern ids. The token
+// type is packed into the top bits. Wildcard tokens (identifiers, strings,
+// numerics) all share the id of their type and operators use their kind, so
+// only keywords, comments and other characters are looked up by text. Two
+// lines have the same token pattern exactly when their id arrays are equal.
+// Keys are views into the document and entries live in the document's arena,
+// so the table must be destroyed before either goes away. With copy_keys, new
+// keys are copied into the arena instead, so ids stay valid while the lines
+// they came from are edited.
+class SymbolTable {
+  public:
+    static constexpr int type_shift = 30;
+
+    explicit SymbolTable(Arena &arena, bool copy_keys = false)
+        : ids(ArenaAllocator<Entry>(arena)), key_arena(copy_keys ? &arena : nullptr) {}
+
+    uint32_t intern(string_view text, TokenKind kind) {
+        TokenType type = token_type(kind);
+        if (type != TokenType::Exact) return pack(type, 0);
+        // Operators and delimiters are identified by their kind alone.
+        if (kind >= TokenKind::Plus) return pack(type, static_cast<uint32_t>(kind));
+        if (key_arena) {
+            auto it = ids.find(text);
+            if (it != ids.end()) return it->second;
+            span<char> key = key_arena->copy(span<const char>(text));
+            text = string_view(key.data(), key.size());
+        }
+        auto [it, inserted] = ids.try_emplace(text, 0);
+        if (inserted) it->second = pack(type, next_id++);
+        return it->second;
+    }
+
+    void clear() {
+        ids.clear();
+        next_id = num_token_kinds;
+    }
+
+  private:
+    static uint32_t pack(TokenType type, uint32_t index) {
+        return static_cast<uint32_t>(type) << type_shift | index;
+    }
+
+    using Entry = pair<const string_view, uint32_t>;
+    unordered_map<string_view, uint32_t, hash<string_view>, equal_to<string_view>,
+                  ArenaAllocator<Entry>>
+        ids;
+    Arena *key_arena;
+    uint32_t next_id = num_token_kinds;
+};
+
+// Rolling 64-bit hash over interned pattern ids (FNV-1a over 32-bit words).
+// Lines with different signatures never share a pattern; equal signatures
+// still need patterns_equal to confirm.
+constexpr uint64_t pattern_signature_seed = 0xcbf29ce484222325ull;
+inline uint64_t pattern_signature_step(uint64_t sig, uint32_t id) {
+    return (sig ^ id) * 0x100000001b3ull;
+}
+
+bool patterns_equal(span<const uint32_t> a, span<const uint32_t> b) {
+    return a.size() == b.size() &&
+           (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(uint32_t)) == 0);
 }
 
 // Compares two token vectors using wildcard rules.
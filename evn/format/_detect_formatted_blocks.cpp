@@ -146,6 +146,114 @@ array<array<float, NUM_GROUPS>, NUM_GROUPS> create_default_submatrix() {
     return matrix;
 }
 
+// Set in group_table entries for letters and digits.
+constexpr uint8_t ALNUM_FLAG = 0x80;
+// Row length of the quantized substitution matrix, so a pair of groups is
+// indexed with a shift.
+constexpr int PAIR_STRIDE = 64;
+
+// Character group of every byte, with ALNUM_FLAG set on letters and digits, so
+// a byte is classified with one load. Padded for 32-bit gathers.
+const array<uint8_t, 256 + 3> &group_table() {
+    static const array<uint8_t, 256 + 3> table = [] {
+        array<uint8_t, 256 + 3> t{};
+        for (int c = 0; c < 256; c++) {
+            t[c] = get_char_group(static_cast<char>(c));
+            if (isalnum(c)) t[c] |= ALNUM_FLAG;
+        }
+        return t;
+    }();
+    return table;
+}
+
+// The AVX2 kernel is built when the compiler targets AVX2. Otherwise, on
+// x86-64 GCC and Clang, it is built for AVX2 alone and used if the CPU has it,
+// so default (SSE2) builds get it too.
+#if defined(EVN_CHAR_CLASS_AVX2)
+#define EVN_SIMILARITY_AVX2 1
+#define EVN_TARGET_AVX2
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define EVN_SIMILARITY_AVX2 1
+#define EVN_SIMILARITY_DISPATCH 1
+#define EVN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(EVN_SIMILARITY_AVX2)
+// Widens the 8 bytes at p to 32-bit lanes.
+EVN_TARGET_AVX2 inline __m256i load8(const char *p) {
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)));
+}
+
+// Scores of the 8 columns of a and b, one per 32-bit lane.
+EVN_TARGET_AVX2 inline __m256i score8(const uint8_t *groups, const int16_t *pairs,
+                                      const char *a, const char *b) {
+    static_assert(PAIR_STRIDE == 1 << 6);
+    const __m256i low_byte = _mm256_set1_epi32(0xff);
+    const __m256i flag = _mm256_set1_epi32(ALNUM_FLAG);
+    const __m256i group_mask = _mm256_set1_epi32(ALNUM_FLAG - 1);
+    __m256i ca = load8(a), cb = load8(b);
+    const int *group_words = reinterpret_cast<const int *>(groups);
+    __m256i ga = _mm256_and_si256(_mm256_i32gather_epi32(group_words, ca, 1), low_byte);
+    __m256i gb = _mm256_and_si256(_mm256_i32gather_epi32(group_words, cb, 1), low_byte);
+    __m256i both_alnum =
+        _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_and_si256(ga, gb), flag), flag);
+    __m256i skip = _mm256_andnot_si256(_mm256_cmpeq_epi32(ca, cb), both_alnum);
+    __m256i row = _mm256_slli_epi32(_mm256_and_si256(ga, group_mask), 6);
+    __m256i index = _mm256_or_si256(row, _mm256_and_si256(gb, group_mask));
+    const int *pair_words = reinterpret_cast<const int *>(pairs);
+    __m256i score = _mm256_i32gather_epi32(pair_words, index, 2);
+    score = _mm256_srai_epi32(_mm256_slli_epi32(score, 16), 16);
+    return _mm256_andnot_si256(skip, score);
+}
+
+// Sums the scores of the first n / 16 * 16 columns, 16 per step, and sets i
+// to the first column left.
+EVN_TARGET_AVX2 int64_t alignment_sum_avx2(const char *a, const char *b, size_t n,
+                                           const int16_t *pairs, size_t &i) {
+    const uint8_t *groups = group_table().data();
+    int64_t sum = 0;
+    // At most 2^15 columns are summed between flushes, so lanes cannot
+    // overflow.
+    while (n - i >= 16) {
+        size_t stop = i + min((n - i) & ~size_t(15), size_t(1) << 15);
+        __m256i acc = _mm256_setzero_si256();
+        for (; i < stop; i += 16)
+            acc = _mm256_add_epi32(
+                acc, _mm256_add_epi32(score8(groups, pairs, a + i, b + i),
+                                      score8(groups, pairs, a + i + 8, b + i + 8)));
+        alignas(32) int32_t lanes[8];
+        _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), acc);
+        for (int32_t lane : lanes) sum += lane;
+    }
+    return sum;
+}
+#endif
+
+// Sums the scores of the first n columns of a and b, where pairs holds the
+// score of groups g1 and g2 at g1 * PAIR_STRIDE + g2. Columns holding two
+// different letters or digits score 0. With AVX2, 16 columns are scored per
+// step by gathering groups and scores into 32-bit lanes.
+int64_t alignment_sum(const char *a, const char *b, size_t n, const int16_t *pairs) {
+    const uint8_t *groups = group_table().data();
+    int64_t sum = 0;
+    size_t i = 0;
+#if defined(EVN_SIMILARITY_DISPATCH)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) sum = alignment_sum_avx2(a, b, n, pairs, i);
+#elif defined(EVN_SIMILARITY_AVX2)
+    sum = alignment_sum_avx2(a, b, n, pairs, i);
+#endif
+    for (; i < n; i++) {
+        uint8_t ga = groups[static_cast<unsigned char>(a[i])];
+        uint8_t gb = groups[static_cast<unsigned char>(b[i])];
+        bool skip = (ga & gb & ALNUM_FLAG) && a[i] != b[i];
+        int score = pairs[(ga & ~ALNUM_FLAG) * PAIR_STRIDE + (gb & ~ALNUM_FLAG)];
+        sum += skip ? 0 : score;
+    }
+    return sum;
+}
+
 class IdentifyFormattedBlocks {
   public:
     array<array<float, NUM_GROUPS>, NUM_GROUPS> sub_matrix;
@@ -154,37 +262,38 @@ class IdentifyFormattedBlocks {
     vector<float> scores;
     size_t consecutive_high_scores = 0;
     float threshold = 5.0f;
+    // sub_matrix in fixed point with score_scale units per point, padded for
+    // 32-bit gathers.
+    array<int16_t, NUM_GROUPS * PAIR_STRIDE + 1> pair_scores{};
+    float score_scale = 1.0f;
 
     IdentifyFormattedBlocks(float threshold = 5.0f) : threshold(threshold) {
         sub_matrix = create_default_submatrix();
+        quantize();
     }
 
     void set_substitution_matrix(CharGroup i, CharGroup j, float val) {
         sub_matrix[i][j] = val;
+        quantize();
     }
 
-    // Compute similarity score between two lines
+    // Compute similarity score between two lines. Columns are scored with
+    // sub_matrix rounded to multiples of 1 / score_scale (1/2048 for the
+    // default matrix), so the score is within 0.35 * sqrt(n) / score_scale of
+    // the float sum, n being the shorter length: under 0.004 for 400 columns.
     float compute_similarity_score(string const &line1, string const &line2) {
         if (debug) cerr << "compute_similarity_score " << line1 << " " << line2 << endl;
         if (line1.empty() || line2.empty()) return 0.0f;
         size_t indent1 = line1.find_first_not_of(" \t");
         size_t indent2 = line2.find_first_not_of(" \t");
         if (indent1 != indent2) return 0.0f;
-        float alignmentScore = 0.0f;
         size_t len1 = line1.size();
         size_t len2 = line2.size();
 
         // Score character by character for alignment
-        for (size_t i = 0; i < min(len1, len2); i++) {
-            if (isalnum(static_cast<unsigned char>(line1[i])) &&
-                isalnum(static_cast<unsigned char>(line2[i])) && line1[i] != line2[i])
-                continue;
-            CharGroup g1 = get_char_group(line1[i]);
-            CharGroup g2 = get_char_group(line2[i]);
-            if (debug) cerr << i << " g1 " << g1 << " g2 " << g2 << endl;
-            alignmentScore += sub_matrix[g1][g2];
-        }
-        if (debug) cerr << "adject for len" << endl;
+        size_t n = min(len1, len2);
+        int64_t sum = alignment_sum(line1.data(), line2.data(), n, pair_scores.data());
+        float alignmentScore = sum / score_scale;
         float maxlen = static_cast<float>(max(line1.size(), line2.size()));
         alignmentScore = alignmentScore / sqrt(maxlen);
         float lengthPenalty =
@@ -206,9 +315,7 @@ class IdentifyFormattedBlocks {
                 continue;
             output.push_back(line);
         }
-        ostringstream result;
-        for (string const &line : output) { result << line << endl; }
-        return result.str();
+        return join_lines(output);
     }
 
     void start_new_code(string const &code) {
@@ -220,11 +327,7 @@ class IdentifyFormattedBlocks {
         while (getline(stream, line)) lines.push_back(line);
         in_formatted_block = false;
     }
-    string finish_code() {
-        ostringstream result;
-        for (const string &line : output) { result << line << endl; }
-        return result.str();
-    }
+    string finish_code() { return join_lines(output); }
 
     // Process code to identify and mark well-formatted blocks
     string mark_formtted_blocks(string const &code, float thresh = 0) {
@@ -234,43 +337,99 @@ class IdentifyFormattedBlocks {
         output.push_back(lines[0]);
 
         consecutive_high_scores = 0;
-        for (size_t i = 1; i < lines.size(); i++) {
-            if (is_multiline(lines[i - 1]) || is_multiline(lines[i])) {
-                if (debug) cerr << "multiline " << lines[i] << endl;
-                maybe_close_formatted_block();
-                output.push_back(lines[i]);
-                continue;
-            }
-            string i_indent = get_indentation(lines[i]);
-            if (!in_formatted_block && is_oneline_statement_string(lines[i])) {
-                if (debug) cerr << "oneline " << lines[i] << endl;
-                maybe_close_formatted_block();
-                // cout << "single " << lines[i] << endl;
-                output.push_back(i_indent + "#             fmt: off");
-                output.push_back(lines[i]);
-                output.push_back(i_indent + "#             fmt: on");
-                continue;
-            }
-            scores.push_back(compute_similarity_score(lines[i - 1], lines[i]));
-            if (scores.back() >= threshold) {
-                if (debug) cerr << "block " << scores.back() << " " << lines[i] << endl;
-                consecutive_high_scores++;
-                if (consecutive_high_scores >= 1 && !in_formatted_block) {
-                    in_formatted_block = true;
-                    string tmp = output.back();
-                    output.back() = i_indent + "#             fmt: off";
-                    output.push_back(tmp);
-                    output.push_back(lines[i]);
-                    continue;
-                }
-            } else {
-                maybe_close_formatted_block();
-            }
-            output.push_back(lines[i]);
+        for (size_t i = 1; i < lines.size(); i++) mark_line(i);
+        maybe_close_formatted_block(true);
+        return finish_code();
+    }
+
+    // Marks blocks only around the lines in ranges, each a [begin, end) pair of
+    // line indices from 0, and copies other lines through unmarked. Marking
+    // starts from the nearest line before a range after which no block can be
+    // open, and runs past the range until no block is open, so only those lines
+    // are scored.
+    string mark_formtted_ranges(string const &code, vector<pair<size_t, size_t>> ranges,
+                                float thresh = 0) {
+        start_new_code(code);
+        if (thresh > 0) threshold = thresh;
+        if (lines.empty()) return code;
+        output.push_back(lines[0]);
+
+        consecutive_high_scores = 0;
+        // Whether line i closes any open block and is not tagged on its own.
+        auto closes = [&](size_t i) {
+            return is_multiline(lines[i - 1]) || is_multiline(lines[i]) ||
+                   (!is_oneline_statement_string(lines[i]) &&
+                    compute_similarity_score(lines[i - 1], lines[i]) < threshold);
+        };
+        sort(ranges.begin(), ranges.end());
+        size_t next = 1; // Next line to mark; no block is open before it.
+        for (auto [first, last] : ranges) {
+            last = min(last, lines.size());
+            if (first >= last || last < next) continue;
+            size_t start = max(first, next);
+            while (start > next && !closes(start - 1)) --start;
+            for (; next < start; next++) output.push_back(lines[next]);
+            // The line after the range may still join it in a block.
+            for (bool tagged = false;
+                 next < lines.size() && (next <= last || in_formatted_block || tagged);
+                 next++)
+                tagged = mark_line(next);
         }
+        for (; next < lines.size(); next++) output.push_back(lines[next]);
         maybe_close_formatted_block(true);
         return finish_code();
     }
+
+    // Marks line i given the lines before it. Returns true if the line was
+    // tagged on its own as a one-line statement.
+    bool mark_line(size_t i) {
+        if (is_multiline(lines[i - 1]) || is_multiline(lines[i])) {
+            if (debug) cerr << "multiline " << lines[i] << endl;
+            maybe_close_formatted_block();
+            output.push_back(lines[i]);
+            return false;
+        }
+        string i_indent = get_indentation(lines[i]);
+        if (!in_formatted_block && is_oneline_statement_string(lines[i])) {
+            if (debug) cerr << "oneline " << lines[i] << endl;
+            maybe_close_formatted_block();
+            // cout << "single " << lines[i] << endl;
+            output.push_back(i_indent + "#             fmt: off");
+            output.push_back(lines[i]);
+            output.push_back(i_indent + "#             fmt: on");
+            return true;
+        }
+        scores.push_back(compute_similarity_score(lines[i - 1], lines[i]));
+        if (scores.back() >= threshold) {
+            if (debug) cerr << "block " << scores.back() << " " << lines[i] << endl;
+            consecutive_high_scores++;
+            if (consecutive_high_scores >= 1 && !in_formatted_block) {
+                in_formatted_block = true;
+                output.insert(output.end() - 1, i_indent + "#             fmt: off");
+                output.push_back(lines[i]);
+                return false;
+            }
+        } else {
+            maybe_close_formatted_block();
+        }
+        output.push_back(lines[i]);
+        return false;
+    }
+    // Rounds sub_matrix into pair_scores for alignment_sum. score_scale is the
+    // largest power of two up to 2048 that keeps every entry in int16 range.
+    void quantize() {
+        float max_abs = 0.0f;
+        for (const auto &row : sub_matrix)
+            for (float val : row) max_abs = max(max_abs, abs(val));
+        score_scale = 2048.0f;
+        while (score_scale > 1.0f && max_abs * score_scale > INT16_MAX) score_scale /= 2;
+        for (int i = 0; i < NUM_GROUPS; i++)
+            for (int j = 0; j < NUM_GROUPS; j++)
+                pair_scores[i * PAIR_STRIDE + j] = static_cast<int16_t>(
+                    clamp(lround(sub_matrix[i][j] * score_scale), long(INT16_MIN),
+                          long(INT16_MAX)));
+    }
+
     void maybe_close_formatted_block(bool at_end = false) {
         if (!in_formatted_block) return;
         if (debug) cerr << "maybe close block" << endl;
@@ -306,6 +465,11 @@ PYBIND11_MODULE(_detect_formatted_blocks, m) {
              py::arg("code"), py::arg("threshold") = 0.7f,
              "Process the input code and mark formatted blocks based on a "
              "similarity threshold.")
+        .def("mark_formtted_ranges", &IdentifyFormattedBlocks::mark_formtted_ranges,
+             py::arg("code"), py::arg("ranges"), py::arg("threshold") = 0.7f,
+             "Mark formatted blocks only around the lines in ranges, a list of "
+             "(begin, end) line indices from 0 with end excluded, copying all "
+             "other lines unmarked.")
         .def("unmark", &IdentifyFormattedBlocks::unmark, py::arg("code"),
              "remove marks.");
 
@@ -0,0 +1,60 @@
+"""
+Regenerates _unicode_tables.hpp from the unicodedata of the running Python.
+
+    python evn/format/_gen_unicode_tables.py
+
+Identifier classes come from str.isidentifier, so the tokenizer accepts
+exactly the identifiers this Python version does. Display widths follow
+wcwidth: combining marks, format characters (except the soft hyphen) and
+Hangul medial jamo take no columns; East Asian Wide and Fullwidth characters
+take two.
+"""
+
+import sys
+import unicodedata
+from pathlib import Path
+
+def ranges(pred):
+    result, start = [], None
+    for cp in range(0x80, sys.maxunicode + 2):
+        inside = cp <= sys.maxunicode and pred(chr(cp))
+        if inside and start is None: start = cp
+        if not inside and start is not None:
+            result.append((start, cp - 1))
+            start = None
+    return result
+
+def zero_width(c):
+    if c == '\u00ad': return False
+    return unicodedata.category(c) in ('Mn', 'Me', 'Cf') or '\u1160' <= c <= '\u11ff'
+
+def wide(c):
+    return not zero_width(c) and unicodedata.east_asian_width(c) in ('W', 'F')
+
+def table(name, rngs, per_row=3):
+    cells = [f'{{0x{a:04X}, 0x{b:04X}}},' for a, b in rngs]
+    rows = ['    ' + ' '.join(cells[i:i + per_row]) for i in range(0, len(cells), per_row)]
+    return f'constexpr CodepointRange {name}[] = {{\n' + '\n'.join(rows) + '\n};\n'
+
+def main():
+    xid_start = ranges(lambda c: c.isidentifier())
+    xid_continue = ranges(lambda c: ('a' + c).isidentifier())
+    zero = ranges(zero_width)
+    wide_ = ranges(wide)
+    out = Path(__file__).with_name('_unicode_tables.hpp')
+    out.write_text(f'''// _unicode_tables.hpp
+// Generated by _gen_unicode_tables.py from Unicode {unicodedata.unidata_version}. Do not edit.
+// Sorted, disjoint ranges of non-ASCII code points.
+#pragma once
+
+struct CodepointRange {{
+    char32_t first, last;
+}};
+
+{table('xid_start_ranges', xid_start)}
+{table('xid_continue_ranges', xid_continue)}
+{table('zero_width_ranges', zero)}
+{table('wide_ranges', wide_)}''')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,108 @@
+// _line_stream.hpp
+// Line-at-a-time input and buffered line output on file descriptors, for
+// formatting files too large to hold in memory.
+#pragma once
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+inline long read_fd(int fd, char *buf, size_t n) {
+#ifdef _WIN32
+    return _read(fd, buf, static_cast<unsigned>(n));
+#else
+    long got;
+    while ((got = ::read(fd, buf, n)) < 0 && errno == EINTR) {}
+    return got;
+#endif
+}
+
+inline long write_fd(int fd, const char *buf, size_t n) {
+#ifdef _WIN32
+    return _write(fd, buf, static_cast<unsigned>(n));
+#else
+    long put;
+    while ((put = ::write(fd, buf, n)) < 0 && errno == EINTR) {}
+    return put;
+#endif
+}
+
+// Reads lines from a file descriptor the way getline splits a string: the
+// '\n' is dropped and a last line without one is still returned. Only the
+// current line is buffered; the buffer grows if a single line outgrows it.
+class FdLineReader {
+  public:
+    explicit FdLineReader(int fd, size_t buffer_size = 1 << 16)
+        : fd(fd), buffer(buffer_size) {}
+
+    // Sets line to the next line, valid until the next call. Returns false at
+    // the end of the input.
+    bool next(std::string_view &line) {
+        while (true) {
+            char *begin = buffer.data() + pos, *end = buffer.data() + filled;
+            if (auto nl = static_cast<char *>(std::memchr(begin, '\n', end - begin))) {
+                line = std::string_view(begin, nl - begin);
+                pos = nl + 1 - buffer.data();
+                return true;
+            }
+            if (eof) {
+                line = std::string_view(begin, end - begin);
+                pos = filled;
+                return begin != end;
+            }
+            std::memmove(buffer.data(), begin, end - begin);
+            filled = end - begin;
+            pos = 0;
+            if (filled == buffer.size()) buffer.resize(2 * buffer.size());
+            long got = read_fd(fd, buffer.data() + filled, buffer.size() - filled);
+            if (got < 0) throw std::runtime_error("Error reading input: " +
+                                                  std::string(std::strerror(errno)));
+            if (got == 0) eof = true;
+            filled += got;
+        }
+    }
+
+  private:
+    int fd;
+    std::vector<char> buffer;
+    size_t pos = 0, filled = 0;
+    bool eof = false;
+};
+
+// Writes '\n'-terminated lines to a file descriptor in large writes. Call
+// flush() when done; the destructor does not, so errors are not lost.
+class FdLineWriter {
+  public:
+    explicit FdLineWriter(int fd, size_t buffer_size = 1 << 16)
+        : fd(fd), buffer_size(buffer_size) {
+        buffer.reserve(buffer_size);
+    }
+
+    void write_line(std::string_view line) {
+        buffer.append(line).push_back('\n');
+        if (buffer.size() >= buffer_size) flush();
+    }
+
+    void flush() {
+        for (size_t done = 0; done < buffer.size();) {
+            long put = write_fd(fd, buffer.data() + done, buffer.size() - done);
+            if (put < 0) throw std::runtime_error("Error writing output: " +
+                                                  std::string(std::strerror(errno)));
+            done += put;
+        }
+        buffer.clear();
+    }
+
+  private:
+    int fd;
+    size_t buffer_size;
+    std::string buffer;
+};
@@ -0,0 +1,46 @@
+// _lru_cache.hpp
+// Fixed-capacity map that evicts the least recently used entry when full.
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+template <typename Key, typename Value, typename Hash = std::hash<Key>> class LruCache {
+  public:
+    explicit LruCache(size_t capacity) : max_size(capacity) {}
+
+    // Returns the value for key, or nullptr. A hit becomes the most recent.
+    Value *find(const Key &key) {
+        auto it = index.find(key);
+        if (it == index.end()) return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+
+    // Adds key as the most recent entry, evicting the least recent if the
+    // cache is full, and returns its value for the caller to fill in. The value
+    // is either new or the evicted one, so a full cache reuses its storage.
+    // key must not be in the cache.
+    Value &insert(const Key &key) {
+        if (entries.size() < max_size) {
+            entries.emplace_front(key, Value());
+        } else {
+            entries.splice(entries.begin(), entries, std::prev(entries.end()));
+            index.erase(entries.front().first);
+            entries.front().first = key;
+        }
+        index.emplace(key, entries.begin());
+        return entries.front().second;
+    }
+
+    size_t size() const { return entries.size(); }
+    size_t capacity() const { return max_size; }
+
+  private:
+    size_t max_size;
+    std::list<std::pair<Key, Value>> entries; // Most recent first.
+    std::unordered_map<Key, typename std::list<std::pair<Key, Value>>::iterator, Hash>
+        index;
+};
@@ -0,0 +1,85 @@
+// _text_builder.hpp
+// Output text assembled in a single buffer. Callers reserve the final size up
+// front where they can compute it, then append spans and padding in place, so
+// a document is built without per-line temporaries or stream flushes, and the
+// finished string is moved out rather than copied.
+#pragma once
+#include <cctype>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+
+class TextBuilder {
+  public:
+    explicit TextBuilder(size_t capacity = 0) { text.reserve(capacity); }
+
+    TextBuilder &append(std::string_view s) {
+        text.append(s);
+        return *this;
+    }
+
+    TextBuilder &pad(size_t n) {
+        text.append(n, ' ');
+        return *this;
+    }
+
+    // Appends line and a newline; this also makes a TextBuilder a line sink.
+    void write_line(std::string_view line) {
+        text.append(line).push_back('\n');
+        ++num_lines;
+    }
+
+    // Appends a line made of head followed by tail.
+    void write_line(std::string_view head, std::string_view tail) {
+        text.append(head);
+        write_line(tail);
+    }
+
+    // Returns room for a line of up to capacity bytes, to be written in place
+    // and finished by close_line.
+    char *open_line(size_t capacity) {
+        size_t at = text.size();
+        text.resize(at + capacity);
+        return text.data() + at;
+    }
+
+    // Finishes the line written at [begin, end), dropping trailing whitespace.
+    void close_line(const char *begin, const char *end) {
+        while (end > begin && std::isspace(static_cast<unsigned char>(end[-1]))) --end;
+        text.resize(end - text.data());
+        text.push_back('\n');
+        ++num_lines;
+    }
+
+    // Drops trailing whitespace in place.
+    void rstrip() {
+        size_t n = text.size();
+        while (n > 0 && std::isspace(static_cast<unsigned char>(text[n - 1]))) --n;
+        text.resize(n);
+    }
+
+    size_t size() const { return text.size(); }
+    size_t line_count() const { return num_lines; }
+
+    // Returns the text, leaving the builder empty.
+    std::string take() {
+        std::string result = std::move(text);
+        text.clear();
+        num_lines = 0;
+        return result;
+    }
+
+  private:
+    std::string text;
+    size_t num_lines = 0;
+};
+
+// Joins lines into one string with a newline after each, allocated once.
+template <typename Lines> std::string join_lines(const Lines &lines) {
+    size_t size = 0;
+    for (const auto &line : lines) size += std::string_view(line).size() + 1;
+    TextBuilder out(size);
+    for (const auto &line : lines) out.write_line(line);
+    return out.take();
+}
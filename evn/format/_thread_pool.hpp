@@ -0,0 +1,86 @@
+// _thread_pool.hpp
+// Fixed-size pool of worker threads for data-parallel loops. The calling
+// thread takes part in every loop, so a pool of size n starts n - 1 workers.
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+  public:
+    explicit ThreadPool(size_t num_threads) {
+        for (size_t t = 1; t < num_threads; ++t) workers.emplace_back([this] { work(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return workers.size() + 1; }
+
+    // Calls fn(i) for every i in [0, n) and returns when all calls are done.
+    // Indices are handed out one at a time, so uneven items balance out.
+    // Calls must not throw.
+    void parallel_for(size_t n, const std::function<void(size_t)> &fn) {
+        if (n == 0) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            job_size = n;
+            next = 0;
+            busy = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        run(fn, n);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+  private:
+    void run(const std::function<void(size_t)> &fn, size_t n) {
+        for (size_t i = next++; i < n; i = next++) fn(i);
+    }
+
+    void work() {
+        size_t seen = 0;
+        while (true) {
+            const std::function<void(size_t)> *fn;
+            size_t n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                fn = job;
+                n = job_size;
+            }
+            run(*fn, n);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)> *job = nullptr;
+    size_t job_size = 0;
+    std::atomic<size_t> next{0};
+    size_t busy = 0;
+    size_t generation = 0;
+    bool stopping = false;
+};
@@ -1,83 +1,452 @@
 #include "_common.hpp"
+#include "_line_stream.hpp"
+#include "_lru_cache.hpp"
+#include "_thread_pool.hpp"
 
-// Helper struct to store per–line data.
-struct LineInfo {
-    int lineno;             // Line number.
-    string line;            // Original line.
-    string indent;          // Leading whitespace.
-    string content;         // Line without indent.
-    vector<string> tokens;  // Tokenized content.
-    vector<string> pattern; // Token pattern (wildcards)
+// Per-line data for a document, stored column by column so the grouping and
+// width passes stream through dense arrays. Row i is line i; its tokens and
+// pattern ids are entries [token_begin[i], token_begin[i + 1]) of the token
+// columns. Lines view the buffer being reformatted and the columns live in
+// the tokenizer's arena, so both must outlive the table.
+struct LineTable {
+    explicit LineTable(Arena &arena)
+        : line(arena), indent_size(arena), signature(arena), state(arena),
+          verbatim(arena), token_begin(1, 0, arena), tokens(arena), pattern(arena) {}
+
+    arena_vector<string_view> line;     // Original line.
+    arena_vector<uint32_t> indent_size; // Length of the leading whitespace.
+    arena_vector<uint64_t> signature;   // Hash of pattern, for fast mismatch checks.
+    arena_vector<LexState> state;       // Lexer state at the start of the line.
+    arena_vector<uint8_t> verbatim;     // Line starts or ends inside a string literal.
+    arena_vector<uint32_t> token_begin; // First token of each row, plus the end.
+    arena_vector<Token> tokens;         // Token spans into their line.
+    arena_vector<uint32_t> pattern;     // Interned token pattern (wildcards).
+
+    size_t size() const { return line.size(); }
+    string_view indent(size_t i) const { return line[i].substr(0, indent_size[i]); }
+    bool blank(size_t i) const { return indent_size[i] == line[i].size(); }
+    span<const Token> tokens_of(size_t i) const {
+        return {tokens.data() + token_begin[i], token_begin[i + 1] - token_begin[i]};
+    }
+    span<const uint32_t> pattern_of(size_t i) const {
+        return {pattern.data() + token_begin[i], token_begin[i + 1] - token_begin[i]};
+    }
+};
+
+// Tokens and lexer states of a range of lines, lexed without looking at the
+// lines before it so that ranges can be lexed in parallel.
+struct LexedChunk {
+    size_t begin = 0, end = 0; // Line range.
+    LexState entry, exit;      // Lexer state before the first and after the last line.
+    vector<Token> tokens;      // Tokens of all lines in the range.
+    vector<uint32_t> token_end; // End of each line's tokens.
+    vector<LexState> states;   // Lexer state at the start of each line.
+
+    void lex(span<const string_view> lines, LexState state) {
+        entry = state;
+        tokens.clear();
+        token_end.clear();
+        states.clear();
+        for (size_t i = begin; i < end; i++) {
+            states.push_back(state);
+            tokenize_line(lines[i], state, tokens);
+            token_end.push_back(tokens.size());
+        }
+        exit = state;
+    }
+};
+
+// Formatted lines kept as views, so they can be picked out by index: unchanged
+// lines view the input and lines that are built are written into the arena.
+// Like TextBuilder, which writes the lines straight into a document instead,
+// it is an output for format_rows.
+struct ViewOutput {
+    explicit ViewOutput(Arena &arena) : lines(arena), arena(arena) {}
+
+    void write_line(string_view line) { lines.push_back(line); }
+    void write_line(string_view head, string_view tail) {
+        char *buf = arena.allocate_array<char>(head.size() + tail.size());
+        copy(tail.begin(), tail.end(), copy(head.begin(), head.end(), buf));
+        lines.emplace_back(buf, head.size() + tail.size());
+    }
+    char *open_line(size_t capacity) { return arena.allocate_array<char>(capacity); }
+    void close_line(const char *begin, const char *end) {
+        lines.push_back(rstrip(string_view(begin, end - begin)));
+    }
+    size_t line_count() const { return lines.size(); }
+
+    arena_vector<string_view> lines;
+    Arena &arena;
+};
+
+// Compares formatted lines with the source lines at the same position instead
+// of keeping them, as an output for format_rows, and records the first line
+// that differs. Only the line being built is buffered.
+struct CheckOutput {
+    explicit CheckOutput(span<const string_view> source) : source(source) {}
+
+    void write_line(string_view line) { check(line.size(), line, {}); }
+    void write_line(string_view head, string_view tail) {
+        check(head.size() + tail.size(), head, tail);
+    }
+    char *open_line(size_t capacity) {
+        if (buffer.size() < capacity) buffer.resize(capacity);
+        return buffer.data();
+    }
+    void close_line(const char *begin, const char *end) {
+        write_line(rstrip(string_view(begin, end - begin)));
+    }
+    size_t line_count() const { return num_lines; }
+    bool differs() const { return first_difference != SIZE_MAX; }
+
+    span<const string_view> source;
+    string buffer;
+    size_t num_lines = 0;
+    size_t first_difference = SIZE_MAX;
+
+  private:
+    // Checks the line made of head and tail, of the given size.
+    void check(size_t size, string_view head, string_view tail) {
+        if (!differs() &&
+            (num_lines >= source.size() || source[num_lines].size() != size ||
+             !source[num_lines].starts_with(head) ||
+             source[num_lines].substr(head.size()) != tail))
+            first_difference = num_lines;
+        ++num_lines;
+    }
+};
+
+// Delimiters of one line shape; opener is 1 after def, 2 after lambda.
+struct LineDelimiters {
+    uint8_t opener = 0;
+    vector<TokenKind> kinds;
+    vector<string_view> delims;
+};
+
+// Scratch space for flushing blocks: an arena for per-block arrays and a cache
+// of delimiters by line shape. Parts of a document formatted in parallel each
+// get their own.
+struct Workspace {
+    Arena arena;
+    LruCache<uint64_t, LineDelimiters> delimiter_cache{1024};
 };
 
 class PythonLineTokenizer {
   public:
+    // Lines are tokenized on num_threads threads (all cores if 0) when a
+    // document is large enough to split.
+    explicit PythonLineTokenizer(int num_threads = 1) {
+        if (num_threads <= 0) num_threads = max(1u, thread::hardware_concurrency());
+        if (num_threads > 1) pool = make_unique<ThreadPool>(num_threads);
+        workspaces.push_back(make_unique<Workspace>());
+    }
+
+    int num_threads() const { return pool ? static_cast<int>(pool->size()) : 1; }
+
     // Reformat the given code buffer (as a string) into a new string.
     // Each line is processed, and consecutive lines that share the same
     // token pattern (by wildcard) and the same indentation are grouped and
     // aligned. If add_fmt_tag is true, formatting tags are added.
     string reformat_buffer(const string &code, bool add_fmt_tag = false,
                            bool debug = false) {
-        istringstream stream(code);
-        string line;
-        vector<string> lines;
-        while (getline(stream, line)) lines.push_back(line);
-        vector<string> output = reformat_lines(lines, add_fmt_tag, debug);
-        ostringstream result;
-        for (const auto &outline : output) result << outline << "\n";
-        return result.str();
+        lock_guard<mutex> lock(busy);
+        start_document();
+        auto lines = split_lines(code, ArenaAllocator<string_view>(arena));
+        LineTable table = line_table(lines);
+        // Lines are written straight into the result; aligned lines grow a
+        // little, so the input size plus a quarter usually fits.
+        TextBuilder output(code.size() + code.size() / 4);
+        arena_vector<size_t> parts = split_rows(table, debug);
+        if (parts.size() == 2) {
+            format_rows(*workspaces[0], table, 0, table.size(), output, add_fmt_tag,
+                        debug, [](size_t) { return true; });
+            return output.take();
+        }
+        vector<string> texts(parts.size() - 1);
+        pool->parallel_for(texts.size(), [&](size_t p) {
+            string_view first = table.line[parts[p]], last = table.line[parts[p + 1] - 1];
+            size_t size = last.data() + last.size() + 1 - first.data();
+            TextBuilder text(size + size / 4);
+            format_rows(*workspaces[p], table, parts[p], parts[p + 1], text, add_fmt_tag,
+                        false, [](size_t) { return true; });
+            texts[p] = text.take();
+        });
+        for (const string &text : texts) output.append(text);
+        return output.take();
+    }
+
+    // Cuts a table into parts to format in parallel, returned as the first row
+    // of each part followed by the end. Grouping restarts after every blank or
+    // verbatim line, so parts formatted on their own and joined in order give
+    // the same output as the whole table; each cut follows the first such line
+    // after an even split. Gives one part without a pool, for small tables or
+    // with debug output. Makes sure there is a workspace for each part.
+    arena_vector<size_t> split_rows(const LineTable &table, bool debug = false) {
+        arena_vector<size_t> parts(1, 0, arena);
+        size_t num_parts = 1;
+        if (pool && !debug && table.size() >= 2 * min_chunk_lines)
+            num_parts = min(4 * pool->size(), table.size() / min_chunk_lines);
+        for (size_t p = 1; p < num_parts; p++) {
+            size_t row = max(parts.back(), table.size() * p / num_parts);
+            while (row < table.size() && !table.verbatim[row] && !table.blank(row)) row++;
+            if (row + 1 >= table.size()) break;
+            parts.push_back(row + 1);
+        }
+        parts.push_back(table.size());
+        while (workspaces.size() < parts.size() - 1)
+            workspaces.push_back(make_unique<Workspace>());
+        return parts;
+    }
+
+    // Returns the first line of code that reformat_buffer would change, or
+    // nothing if code is already formatted. Formatted lines are compared with
+    // the source as blocks are flushed, without building the output, and
+    // grouping stops at the first difference.
+    optional<size_t> check_buffer(const string &code, bool add_fmt_tag = false) {
+        lock_guard<mutex> lock(busy);
+        start_document();
+        auto lines = split_lines(code, ArenaAllocator<string_view>(arena));
+        LineTable table = line_table(lines);
+        CheckOutput output(lines);
+        format_rows(*workspaces[0], table, 0, table.size(), output, add_fmt_tag, false,
+                    [&](size_t) { return !output.differs(); });
+        if (output.differs()) return output.first_difference;
+        // Each row gives at least one line, so all lines matched one to one;
+        // only the newline after the last can be missing.
+        if (!code.empty() && code.back() != '\n') return lines.size() - 1;
+        return nullopt;
+    }
+
+    // Reformats only the lines in ranges, each a [begin, end) pair of line
+    // indices from 0, and copies every other line through untouched; a block
+    // that overlaps a range is formatted whole. Grouping always restarts after
+    // a blank or verbatim line, so lines are tokenized only from the one before
+    // each range to the one after it, which is included to flush the last block
+    // the same way. Elsewhere only open strings are followed, to find those lines.
+    string reformat_ranges(const string &code, vector<pair<size_t, size_t>> ranges,
+                           bool add_fmt_tag = false) {
+        lock_guard<mutex> lock(busy);
+        start_document();
+        auto lines = split_lines(code, ArenaAllocator<string_view>(arena));
+        size_t n = lines.size();
+        arena_vector<LexState> states(n + 1, LexState(), arena); // At each line start.
+        for (size_t i = 0; i < n; i++) {
+            states[i + 1] = states[i];
+            skip_line(lines[i], states[i + 1]);
+        }
+        auto boundary = [&](size_t i) {
+            return states[i].in_string() || states[i + 1].in_string() ||
+                   lines[i].find_first_not_of(" \t") == string_view::npos;
+        };
+
+        // Sorted, disjoint ranges, so each unit is checked with a binary search.
+        for (auto &[first, last] : ranges) last = min(last, n);
+        ranges.erase(remove_if(ranges.begin(), ranges.end(),
+                               [](auto &r) { return r.first >= r.second; }),
+                     ranges.end());
+        sort(ranges.begin(), ranges.end());
+        size_t merged = 0;
+        for (auto &r : ranges) {
+            if (merged && r.first <= ranges[merged - 1].second)
+                ranges[merged - 1].second = max(ranges[merged - 1].second, r.second);
+            else ranges[merged++] = r;
+        }
+        ranges.resize(merged);
+        auto touched = [&](size_t begin, size_t end) {
+            auto it = upper_bound(ranges.begin(), ranges.end(), make_pair(begin, n + 1));
+            return (it != ranges.begin() && prev(it)->second > begin) ||
+                   (it != ranges.end() && it->first < end);
+        };
+
+        TextBuilder output(code.size() + code.size() / 8);
+        size_t done = 0; // Lines before done are written.
+        for (auto [first, last] : ranges) {
+            if (last <= done) continue;
+            size_t begin = max(first, done), end = last;
+            while (begin > done && !boundary(begin - 1)) --begin;
+            while (end < n && !boundary(end++)) {}
+            for (; done < begin; done++) output.write_line(lines[done]);
+
+            LineTable table =
+                line_table({lines.data() + begin, end - begin}, states[begin]);
+            ViewOutput formatted(arena);
+            arena_vector<pair<size_t, size_t>> units(arena); // First row and output line.
+            auto at_unit = [&](size_t row) {
+                if (begin + row >= last) return false;
+                units.emplace_back(row, formatted.line_count());
+                return true;
+            };
+            size_t stop = format_rows(*workspaces[0], table, 0, table.size(), formatted,
+                                      add_fmt_tag, false, at_unit);
+            units.emplace_back(stop, formatted.line_count());
+            for (size_t u = 0; u + 1 < units.size(); u++) {
+                auto [row, line] = units[u];
+                auto [next_row, next_line] = units[u + 1];
+                if (touched(begin + row, begin + next_row))
+                    for (size_t l = line; l < next_line; l++)
+                        output.write_line(formatted.lines[l]);
+                else
+                    for (size_t r = row; r < next_row; r++)
+                        output.write_line(table.line[r]);
+            }
+            done = begin + stop;
+        }
+        for (; done < n; done++) output.write_line(lines[done]);
+        return output.take();
     }
 
     // Process a vector of lines.
     vector<string> reformat_lines(const vector<string> &lines, bool add_fmt_tag = false,
                                   bool debug = false) {
-        vector<LineInfo> infos = line_info(lines);
-        vector<string> output;
-        vector<LineInfo> block;
+        lock_guard<mutex> lock(busy);
+        start_document();
+        arena_vector<string_view> views(lines.begin(), lines.end(),
+                                        ArenaAllocator<string_view>(arena));
+        arena_vector<string_view> output = reformat_views(views, add_fmt_tag, debug);
+        return vector<string>(output.begin(), output.end());
+    }
+
+    // Reformats the lines of source into sink as a stream, for files too large
+    // to hold in memory. Lines are read in chunks of about chunk_bytes; each
+    // chunk is formatted like a document, and all of its output except the last
+    // unit is written to sink. The last unit may continue into the next chunk,
+    // so its lines are carried over and formatted again with it. Blocks longer
+    // than max_block_lines are split, which bounds what is carried; otherwise
+    // the output is the same as reformat_buffer's. Source has
+    // bool next(string_view &line) and sink has write_line(string_view).
+    // Returns the number of lines written.
+    template <typename Source, typename Sink>
+    size_t reformat_stream(Source &source, Sink &sink, bool add_fmt_tag = false,
+                           size_t max_block_lines = 1 << 14) {
+        const size_t chunk_bytes = 1 << 20;
+        lock_guard<mutex> lock(busy);
+        string carry; // Lines of the unfinished unit, each ending in '\n'.
+        LexState carry_state;
+        size_t written = 0;
+        for (bool more = true; more;) {
+            start_document();
+            arena_vector<string_view> lines =
+                split_lines(carry, ArenaAllocator<string_view>(arena));
+            for (string_view &line : lines) line = arena_copy(line);
+            // Read at least as much as is carried, so lines are formatted again
+            // at most once on average.
+            string_view line;
+            size_t read_bytes = max(chunk_bytes, carry.size());
+            for (size_t bytes = 0; bytes < read_bytes; bytes += line.size() + 1) {
+                if (!(more = source.next(line))) break;
+                lines.push_back(arena_copy(line));
+            }
+            LineTable table = line_table(lines, carry_state);
+            ViewOutput output(arena);
+            size_t last_row = 0, last_line = 0;
+            format_rows(
+                *workspaces[0], table, 0, table.size(), output, add_fmt_tag, false,
+                [&](size_t row) {
+                    last_row = row;
+                    last_line = output.line_count();
+                    return true;
+                },
+                max_block_lines);
+            size_t done = more ? last_line : output.line_count();
+            for (size_t i = 0; i < done; i++) sink.write_line(output.lines[i]);
+            written += done;
+            carry.clear();
+            if (!more) break;
+            carry_state = table.state[last_row];
+            for (size_t i = last_row; i < table.size(); i++)
+                carry.append(table.line[i]).push_back('\n');
+        }
+        return written;
+    }
+
+    // Process a span of line views; the underlying buffer must outlive the call.
+    // The output lines live in the tokenizer's arena and are valid until the
+    // next document is started.
+    arena_vector<string_view> reformat_views(span<const string_view> lines,
+                                             bool add_fmt_tag = false,
+                                             bool debug = false) {
+        LineTable table = line_table(lines);
+        ViewOutput output(arena);
+        output.lines.reserve(lines.size() + lines.size() / 4);
+        format_rows(*workspaces[0], table, 0, table.size(), output, add_fmt_tag, debug,
+                    [](size_t) { return true; });
+        return move(output.lines);
+    }
+
+    // Groups rows [begin, end) of a table into blocks and flushes them into
+    // output, a ViewOutput or TextBuilder. Rows is a LineTable or a type with
+    // the same columns. Output is made of units that each start at a row: a
+    // block, a blank line or a verbatim line. at_unit(row) is called as each
+    // unit starts, and grouping stops before that row if it returns false.
+    // Blocks are split after max_block rows. Returns the row it stopped at.
+    template <typename Rows, typename Output, typename AtUnit>
+    size_t format_rows(Workspace &ws, const Rows &table, size_t begin, size_t end,
+                       Output &output, bool add_fmt_tag, bool debug, AtUnit at_unit,
+                       size_t max_block = SIZE_MAX) {
         const size_t length_threshold = 10;
-        for (const auto &info : infos) {
-            if (debug) cout << "reformat " << info.lineno << info.line << endl;
+        size_t block = begin; // The open block is rows [block, i).
+        for (size_t i = begin; i < end; i++) {
+            string_view line = table.line[i];
+            if (debug) cout << "reformat " << i << line << endl;
+            // Lines that are part of a multi-line string are output untouched.
+            if (table.verbatim[i]) {
+                flush_block(ws, table, block, i, output, add_fmt_tag, debug);
+                if (!at_unit(i)) return i;
+                output.write_line(line);
+                block = i + 1;
+                continue;
+            }
             // Blank lines are output as-is.
-            if (info.content.empty()) {
-                flush_block(block, output);
-                output.push_back(rstrip(info.line));
+            if (table.blank(i)) {
+                flush_block(ws, table, block, i, output);
+                if (!at_unit(i)) return i;
+                output.write_line(rstrip(line));
+                block = i + 1;
                 continue;
             }
-            if (block.empty()) {
-                block.push_back(info);
-            } else {
-                // Group lines if indent and token pattern match, and if lengths
-                // are similar.
-                try {
-                    if (info.indent != block.at(0).indent ||
-                        abs(static_cast<int>(info.line.size()) -
-                            static_cast<int>(block.at(0).line.size())) >
-                            length_threshold ||
-                        info.pattern != block.at(0).pattern) {
-                        flush_block(block, output, add_fmt_tag, debug);
-                    }
-                } catch (const out_of_range &e) {
-                    throw runtime_error("Error grouping lines: " + string(e.what()));
-                }
-                block.push_back(info);
+            // Group lines if indent and token pattern match, and if lengths
+            // are similar.
+            if (block < i &&
+                (i - block >= max_block || table.signature[i] != table.signature[block] ||
+                 table.indent(i) != table.indent(block) ||
+                 abs(static_cast<int>(line.size()) -
+                     static_cast<int>(table.line[block].size())) > length_threshold ||
+                 !patterns_equal(table.pattern_of(i), table.pattern_of(block)))) {
+                flush_block(ws, table, block, i, output, add_fmt_tag, debug);
+                block = i;
             }
+            if (block == i && !at_unit(i)) return i;
         }
-        flush_block(block, output, add_fmt_tag, debug);
-        return output;
+        flush_block(ws, table, block, end, output, add_fmt_tag, debug);
+        return end;
     }
 
     // Formats tokens by computing a delimiter for each token (except the
     // first). (This implementation is largely unchanged; error checking can be
     // added as needed.)
     vector<string> format_tokens(const vector<string> &tokens) {
-        vector<string> formatted;
+        vector<string> formatted(tokens.size());
         if (tokens.empty()) return formatted;
-        formatted.resize(tokens.size());
-        formatted.at(0) = tokens.at(0); // first token: no preceding delimiter
+        vector<TokenKind> kinds;
+        kinds.reserve(tokens.size());
+        for (const auto &tok : tokens) kinds.push_back(classify_token(tok));
+        vector<string_view> delims(tokens.size());
+        delimiters(tokens.at(0), kinds, delims);
+        for (size_t i = 0; i < tokens.size(); i++)
+            formatted.at(i).append(delims.at(i)).append(tokens.at(i));
+        return formatted;
+    }
 
+    // Computes the delimiter to insert before each token of a line into
+    // delims (empty for the first). first is the text of the first token,
+    // which decides whether def or lambda parameter spacing applies.
+    void delimiters(string_view first, span<const TokenKind> kinds,
+                    span<string_view> delims) {
+        if (kinds.empty()) return;
+        delims[0] = "";
         bool in_param_context = false;
-        bool is_def = (tokens.at(0) == "def");
-        bool is_lambda = (tokens.at(0) == "lambda");
+        bool is_def = (first == "def");
+        bool is_lambda = (first == "lambda");
         if (is_def) {
             in_param_context = false;
         } else if (is_lambda) {
@@ -85,122 +454,505 @@ class PythonLineTokenizer {
         }
 
         int depth = 0;
-        for (size_t i = 1; i < tokens.size(); i++) {
-            string prev = tokens.at(i - 1);
-            if (prev == "(") {
+        for (size_t i = 1; i < kinds.size(); i++) {
+            TokenKind prev = kinds[i - 1];
+            if (prev == TokenKind::LPar) {
                 depth++;
                 if (is_def) in_param_context = true;
-            } else if (prev == ")") {
+            } else if (prev == TokenKind::RPar) {
                 depth--;
                 if (is_def && depth == 0) in_param_context = false;
             }
-            if (is_lambda && tokens.at(i) == ":") { in_param_context = false; }
-            string delim = delimiter(i - 1, i, tokens, in_param_context, depth);
-            formatted.at(i) = delim + tokens.at(i);
+            if (is_lambda && kinds[i] == TokenKind::Colon) in_param_context = false;
+            delims[i] = delimiter(prev, kinds[i], in_param_context, depth);
         }
-        return formatted;
     }
 
-    // Joins tokens into a single string.
+    // Joins tokens into a single string, built in place: each token is its
+    // delimiter and text, padded to widths[i] display columns according to
+    // justifications[i] ('L', 'R' or 'C') when both are given for every token.
     // If skip_formatting is true, assumes tokens are already formatted.
     string join_tokens(const vector<string> &tokens,
                        const vector<int> &widths = vector<int>(),
                        const vector<char> &justifications = vector<char>(),
                        bool skip_formatting = false) {
-        vector<string> formatted_tokens(tokens);
-        if (!skip_formatting) formatted_tokens = format_tokens(tokens);
-        if (!widths.empty() && widths.size() == formatted_tokens.size() &&
-            !justifications.empty() && justifications.size() == formatted_tokens.size()) {
-            for (size_t i = 0; i < formatted_tokens.size(); i++) {
-                if (widths.at(i) > 0) {
-                    int token_len = static_cast<int>(formatted_tokens.at(i).size());
-                    int padding = static_cast<int>(widths.at(i)) - token_len;
-                    if (padding > 0) {
-                        char just = justifications.at(i);
-                        if (just == 'L' || just == 'l') {
-                            formatted_tokens.at(i).append(padding, ' ');
-                        } else if (just == 'R' || just == 'r') {
-                            formatted_tokens.at(i).insert(0, padding, ' ');
-                        } else if (just == 'C' || just == 'c') {
-                            int pad_left = padding / 2;
-                            int pad_right = padding - pad_left;
-                            formatted_tokens.at(i).insert(0, pad_left, ' ');
-                            formatted_tokens.at(i).append(pad_right, ' ');
-                        }
-                    }
-                }
+        vector<string_view> delims(tokens.size());
+        if (!skip_formatting && !tokens.empty()) {
+            vector<TokenKind> kinds;
+            kinds.reserve(tokens.size());
+            for (const auto &tok : tokens) kinds.push_back(classify_token(tok));
+            delimiters(tokens[0], kinds, delims);
+        }
+        bool justify = widths.size() == tokens.size() &&
+                       justifications.size() == tokens.size() && !tokens.empty();
+        size_t size = 0;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            size += delims[i].size() + tokens[i].size();
+            if (justify) size += max(widths[i], 0);
+        }
+        TextBuilder out(size);
+        for (size_t i = 0; i < tokens.size(); i++) {
+            size_t padding = 0, left = 0;
+            if (justify && widths[i] > 0) {
+                int width = static_cast<int>(delims[i].size() + display_width(tokens[i]));
+                padding = max(widths[i] - width, 0);
+                char just = justifications[i];
+                if (just == 'R' || just == 'r') left = padding;
+                else if (just == 'C' || just == 'c') left = padding / 2;
+                else if (just != 'L' && just != 'l') padding = 0;
             }
+            out.pad(left).append(delims[i]).append(tokens[i]).pad(padding - left);
+        }
+        out.rstrip();
+        return out.take();
+    }
+
+    // Builds the LineTable for a document, allocated in the arena.
+    // Lines are tokenized as one document starting from the entry state, so
+    // lexer state (open strings) carries from line to line. Large documents
+    // are split into chunks that are lexed in parallel, each assuming it
+    // starts outside any string; a chunk that turns out to start inside one is
+    // lexed again. Token patterns are then interned in order in the document's
+    // symbol table; verbatim and blank lines get no pattern (ids of 0).
+    LineTable line_table(span<const string_view> lines, LexState entry = LexState()) {
+        size_t num_chunks = 1;
+        if (pool && lines.size() >= 2 * min_chunk_lines)
+            num_chunks = min(4 * pool->size(), lines.size() / min_chunk_lines);
+        if (chunks.size() < num_chunks) chunks.resize(num_chunks);
+        for (size_t c = 0; c < num_chunks; c++) {
+            chunks[c].begin = lines.size() * c / num_chunks;
+            chunks[c].end = lines.size() * (c + 1) / num_chunks;
         }
-        string result;
-        for (const auto &tok : formatted_tokens) result += tok;
-        return rstrip(result);
-    }
-
-    // Returns a vector of LineInfo for each line.
-    vector<LineInfo> line_info(const vector<string> &lines) {
-        vector<LineInfo> infos;
-        for (int i = 0; i < lines.size(); i++) {
-            LineInfo info;
-            info.lineno = i;
-            info.line = lines[i];
-            size_t pos = info.line.find_first_not_of(" \t");
-            info.indent = (pos == string::npos) ? info.line : info.line.substr(0, pos);
-            info.content = (pos == string::npos) ? "" : info.line.substr(pos);
-            if (!info.content.empty()) {
-                info.tokens = tokenize(info.content);
-                info.pattern = get_token_pattern(info.tokens);
+        auto lex = [&](size_t c) { chunks[c].lex(lines, LexState()); };
+        if (num_chunks == 1) lex(0);
+        else pool->parallel_for(num_chunks, lex);
+
+        LexState state = entry;
+        size_t num_tokens = 0;
+        for (size_t c = 0; c < num_chunks; c++) {
+            LexedChunk &chunk = chunks[c];
+            if (chunk.entry.quote != state.quote || chunk.entry.triple != state.triple)
+                chunk.lex(lines, state);
+            state = chunk.exit;
+            num_tokens += chunk.tokens.size();
+        }
+
+        LineTable table(arena);
+        table.line.assign(lines.begin(), lines.end());
+        table.indent_size.resize(lines.size());
+        table.signature.resize(lines.size());
+        table.state.resize(lines.size());
+        table.verbatim.resize(lines.size());
+        table.token_begin.resize(lines.size() + 1);
+        table.tokens.reserve(num_tokens);
+        table.pattern.reserve(num_tokens);
+        for (size_t c = 0; c < num_chunks; c++) {
+            const LexedChunk &chunk = chunks[c];
+            size_t k = 0;
+            for (size_t l = 0; l < chunk.states.size(); l++) {
+                size_t i = chunk.begin + l;
+                string_view line = lines[i];
+                const LexState &next = l + 1 < chunk.states.size() ? chunk.states[l + 1]
+                                                                    : chunk.exit;
+                table.state[i] = chunk.states[l];
+                table.verbatim[i] = table.state[i].in_string() || next.in_string();
+                size_t pos = line.find_first_not_of(" \t");
+                table.indent_size[i] = pos == string::npos ? line.size() : pos;
+                uint64_t signature = pattern_signature_seed;
+                for (; k < chunk.token_end[l]; k++) {
+                    const Token &tok = chunk.tokens[k];
+                    uint32_t id =
+                        table.verbatim[i] ? 0 : symbols->intern(tok.text(line), tok.kind);
+                    table.tokens.push_back(tok);
+                    table.pattern.push_back(id);
+                    signature = pattern_signature_step(signature, id);
+                }
+                table.token_begin[i + 1] = table.tokens.size();
+                table.signature[i] = signature;
             }
-            infos.push_back(info);
         }
-        return infos;
+        return table;
     }
 
-    // Flushes a block of LineInfo objects into output.
-    void flush_block(vector<LineInfo> &block, vector<string> &output,
-                     bool add_fmt_tag = false, bool debug = false) {
-        if (block.empty()) return;
-        if (block.size() == 1) {
-            LineInfo const &info = block.at(0);
-            if (is_oneline_statement(info.tokens)) {
-                output.push_back(info.indent + "#             fmt: off");
-                output.push_back(rstrip(info.line));
-                output.push_back(info.indent + "#             fmt: on");
+    // Flushes the block of rows [begin, end) into output. Aligned lines are
+    // written in place into the output: each token is its delimiter and text,
+    // left-justified to the widest token in its column. Widths are display
+    // columns, so wide (e.g. CJK) and combining characters line up.
+    template <typename Rows, typename Output>
+    void flush_block(Workspace &ws, const Rows &table, size_t begin, size_t end,
+                     Output &output, bool add_fmt_tag = false, bool debug = false) {
+        if (begin == end) return;
+        string_view indent = table.indent(begin);
+        if (end - begin == 1) {
+            string_view line = table.line[begin];
+            if (is_oneline_statement(line, table.tokens_of(begin))) {
+                output.write_line(indent, "#             fmt: off");
+                output.write_line(rstrip(line));
+                output.write_line(indent, "#             fmt: on");
             } else {
-                output.push_back(rstrip(info.line));
+                output.write_line(rstrip(line));
             }
-        } else {
-            vector<vector<string>> token_lines;
-            for (const auto &info : block) token_lines.push_back(info.tokens);
-            vector<vector<string>> formatted_lines;
-            for (auto &tokens : token_lines)
-                formatted_lines.push_back(format_tokens(tokens));
-            size_t nTokens = 0;
-            for (auto &tokens : formatted_lines) nTokens = max(nTokens, tokens.size());
-            vector<int> max_width(nTokens, 0);
-            for (auto &tokens : formatted_lines) {
-                for (size_t j = 0; j < tokens.size(); j++) {
-                    max_width.at(j) =
-                        max(max_width.at(j), static_cast<int>(tokens.at(j).size()));
-                }
+            return;
+        }
+        // Rows of a block share a token pattern, so they have the same token
+        // kinds and the same delimiters.
+        span<const Token> first = table.tokens_of(begin);
+        size_t nTokens = first.size();
+        if (nTokens == 0) {
+            // Lines of only \r, \f or \v have no tokens to align.
+            for (size_t row = begin; row < end; row++)
+                output.write_line(rstrip(table.line[row]));
+            return;
+        }
+        TokenKind *kinds = ws.arena.allocate_array<TokenKind>(nTokens);
+        for (size_t j = 0; j < nTokens; j++) kinds[j] = first[j].kind;
+        span<const string_view> delims =
+            line_delimiters(ws, first[0].text(table.line[begin]), {kinds, nTokens});
+        size_t *max_width = ws.arena.allocate_array<size_t>(nTokens);
+        fill_n(max_width, nTokens, 0);
+        size_t *widths = ws.arena.allocate_array<size_t>(nTokens * (end - begin));
+        for (size_t row = begin; row < end; row++) {
+            string_view line = table.line[row];
+            span<const Token> tokens = table.tokens_of(row);
+            size_t *row_widths = widths + (row - begin) * nTokens;
+            for (size_t j = 0; j < nTokens; j++) {
+                row_widths[j] = delims[j].size() + display_width(tokens[j].text(line));
+                max_width[j] = max(max_width[j], row_widths[j]);
             }
-            vector<char> justifications(nTokens, 'L');
-            if (add_fmt_tag)
-                output.push_back(block.at(0).indent + "#             fmt: off");
-            for (auto &tokens : formatted_lines) {
-                string joined = join_tokens(tokens, max_width, justifications, true);
-                output.push_back(block.at(0).indent + joined);
+        }
+        size_t line_size = indent.size();
+        for (size_t j = 0; j < nTokens; j++) line_size += max_width[j];
+        if (add_fmt_tag) output.write_line(indent, "#             fmt: off");
+        for (size_t row = begin; row < end; row++) {
+            string_view line = table.line[row];
+            span<const Token> tokens = table.tokens_of(row);
+            const size_t *row_widths = widths + (row - begin) * nTokens;
+            // Tokens take at least as many bytes as columns, so this bounds
+            // the padded line.
+            char *buf = output.open_line(line_size + line.size());
+            char *out = copy(indent.begin(), indent.end(), buf);
+            for (size_t j = 0; j < nTokens; j++) {
+                string_view text = tokens[j].text(line);
+                out = copy(delims[j].begin(), delims[j].end(), out);
+                out = copy(text.begin(), text.end(), out);
+                out = fill_n(out, max_width[j] - row_widths[j], ' ');
             }
-            if (add_fmt_tag)
-                output.push_back(block.at(0).indent + "#             fmt: on");
+            output.close_line(buf, out);
+        }
+        if (add_fmt_tag) output.write_line(indent, "#             fmt: on");
+    }
+
+    // Returns the delimiters for a line that starts with first and whose tokens
+    // have the given kinds. They depend on nothing else, so they are cached by
+    // the kinds, in a least recently used cache that lasts as long as the
+    // tokenizer; lines of the same shape share them across blocks and
+    // documents.
+    span<const string_view> line_delimiters(Workspace &ws, string_view first,
+                                            span<const TokenKind> kinds) {
+        uint8_t opener = first == "def" ? 1 : first == "lambda" ? 2 : 0;
+        uint64_t key = pattern_signature_step(pattern_signature_seed, opener);
+        for (TokenKind kind : kinds)
+            key = pattern_signature_step(key, static_cast<uint32_t>(kind));
+        LineDelimiters *entry = ws.delimiter_cache.find(key);
+        if (entry && entry->opener == opener &&
+            equal(kinds.begin(), kinds.end(), entry->kinds.begin(), entry->kinds.end()))
+            return entry->delims;
+        if (!entry) entry = &ws.delimiter_cache.insert(key);
+        entry->opener = opener;
+        entry->kinds.assign(kinds.begin(), kinds.end());
+        entry->delims.resize(kinds.size());
+        delimiters(first, kinds, entry->delims);
+        return entry->delims;
+    }
+
+  protected:
+    // Starts a new document, releasing everything allocated for the last one.
+    void start_document() {
+        symbols.reset();
+        arena.reset();
+        symbols.emplace(arena);
+        for (auto &ws : workspaces) ws->arena.reset();
+    }
+
+    // Returns a copy of text allocated in the arena.
+    string_view arena_copy(string_view text) {
+        span<char> copy = arena.copy(span<const char>(text));
+        return {copy.data(), copy.size()};
+    }
+
+    Arena arena;
+    optional<SymbolTable> symbols;
+    static constexpr size_t min_chunk_lines = 2048; // Smallest part worth a thread.
+    vector<unique_ptr<Workspace>> workspaces; // One per part being formatted.
+    vector<LexedChunk> chunks;
+    unique_ptr<ThreadPool> pool;
+    mutex busy; // Held while a document is being formatted.
+};
+
+// Per-line data of a document that is being edited: the columns of a
+// LineTable, except that each row owns its text and tokens, so rows can be
+// inserted and erased.
+struct EditableTable {
+    vector<string> line;
+    vector<uint32_t> indent_size;
+    vector<uint64_t> signature;
+    vector<LexState> state;
+    vector<uint8_t> verbatim;
+    vector<vector<Token>> tokens;
+    vector<vector<uint32_t>> pattern;
+
+    size_t size() const { return line.size(); }
+    string_view indent(size_t i) const {
+        return string_view(line[i]).substr(0, indent_size[i]);
+    }
+    bool blank(size_t i) const { return indent_size[i] == line[i].size(); }
+    span<const Token> tokens_of(size_t i) const { return tokens[i]; }
+    span<const uint32_t> pattern_of(size_t i) const { return pattern[i]; }
+
+    // Replaces rows [start, start + removed) with lines. Only the text of the
+    // new rows is set; the caller lexes them.
+    void splice(size_t start, size_t removed, span<const string_view> lines) {
+        splice_column(line, start, removed, lines.size());
+        splice_column(indent_size, start, removed, lines.size());
+        splice_column(signature, start, removed, lines.size());
+        splice_column(state, start, removed, lines.size());
+        splice_column(verbatim, start, removed, lines.size());
+        splice_column(tokens, start, removed, lines.size());
+        splice_column(pattern, start, removed, lines.size());
+        for (size_t i = 0; i < lines.size(); i++) line[start + i] = lines[i];
+    }
+
+  private:
+    template <typename T>
+    static void splice_column(vector<T> &column, size_t start, size_t removed,
+                              size_t inserted) {
+        auto at = column.begin() + start;
+        if (inserted > removed) column.insert(at + removed, inserted - removed, T());
+        else column.erase(at + inserted, at + removed);
+    }
+};
+
+// Formats a document as it is edited, for format-on-type. The rows, the units
+// they were grouped into and the formatted output are kept between edits. An
+// edit lexes the new lines and then only as far as the string state takes to
+// fall back in step, regroups from the unit before the edit until a unit
+// starts where one did before, and returns the range of output lines that
+// changed. Ids are interned for the life of the document, so the symbol table
+// grows with every distinct comment or keyword typed until set_text.
+class IncrementalFormatter : private PythonLineTokenizer {
+  public:
+    // An edit to the output: lines [start, start + removed) were replaced.
+    using Replacement = tuple<size_t, size_t, vector<string>>;
+
+    explicit IncrementalFormatter(bool add_fmt_tag = false) : add_fmt_tag(add_fmt_tag) {
+        set_text("");
+    }
+
+    // The symbol table lives in the base class but its entries live in keys.
+    ~IncrementalFormatter() { symbols.reset(); }
+
+    // Replaces the whole document.
+    void set_text(const string &code) {
+        symbols.reset();
+        keys.reset();
+        symbols.emplace(keys, true);
+        rows = EditableTable();
+        units.clear();
+        output.clear();
+        end_state = LexState();
+        arena.reset();
+        workspaces[0]->arena.reset();
+        auto lines = split_lines(code, ArenaAllocator<string_view>(arena));
+        replace(0, 0, lines);
+    }
+
+    // Replaces `removed` source lines from line start with lines, and returns
+    // the smallest range of output lines that changed as a result.
+    Replacement edit(size_t start, size_t removed, const vector<string> &lines) {
+        if (start > rows.size() || removed > rows.size() - start)
+            throw out_of_range("Edit outside the document");
+        arena.reset();
+        workspaces[0]->arena.reset();
+        arena_vector<string_view> views(lines.begin(), lines.end(),
+                                        ArenaAllocator<string_view>(arena));
+        return replace(start, removed, views);
+    }
+
+    size_t num_lines() const { return rows.size(); }
+    const vector<string> &lines() const { return output; }
+
+    string text() const { return join_lines(output); }
+
+  private:
+    // A block, blank line or verbatim line of output, by its first row and
+    // its first output line.
+    struct Unit {
+        uint32_t row, line;
+    };
+
+    Replacement replace(size_t start, size_t removed, span<const string_view> lines) {
+        // Rows before start keep their units, except that the unit holding the
+        // row just before the edit may now extend into it.
+        auto by_row = [](const Unit &u, size_t row) { return u.row < row; };
+        size_t first_unit = 0;
+        if (start > 0 && !units.empty())
+            first_unit = lower_bound(units.begin(), units.end(), start, by_row) -
+                         units.begin() - 1;
+        size_t begin = units.empty() ? 0 : units[first_unit].row;
+        size_t out_begin = units.empty() ? 0 : units[first_unit].line;
+
+        LexState state = start < rows.size() ? rows.state[start] : end_state;
+        rows.splice(start, removed, lines);
+        for (size_t i = start; i < start + lines.size(); i++) lex_row(i, state);
+        // Later rows tokenize as before once they start in the same string.
+        size_t lexed_end = start + lines.size();
+        for (; lexed_end < rows.size(); lexed_end++) {
+            const LexState &old = rows.state[lexed_end];
+            if (old.quote == state.quote && old.triple == state.triple) break;
+            lex_row(lexed_end, state);
+        }
+        if (lexed_end == rows.size()) end_state = state;
+
+        // Regroup until a unit starts on an unchanged row that started a unit
+        // before the edit; grouping from there on is the same as before.
+        ptrdiff_t shift = static_cast<ptrdiff_t>(lines.size()) - removed;
+        size_t last_unit = units.size();
+        arena_vector<Unit> new_units{ArenaAllocator<Unit>(arena)};
+        ViewOutput formatted(arena);
+        const arena_vector<string_view> &new_output = formatted.lines;
+        format_rows(*workspaces[0], rows, begin, rows.size(), formatted, add_fmt_tag,
+                    false, [&](size_t row) {
+                        if (row >= lexed_end) {
+                            size_t old_row = row - shift;
+                            auto it = lower_bound(units.begin() + first_unit, units.end(),
+                                                  old_row, by_row);
+                            if (it != units.end() && it->row == old_row) {
+                                last_unit = it - units.begin();
+                                return false;
+                            }
+                        }
+                        new_units.push_back({static_cast<uint32_t>(row),
+                                             static_cast<uint32_t>(out_begin +
+                                                                   new_output.size())});
+                        return true;
+                    });
+        size_t out_end = last_unit < units.size() ? units[last_unit].line : output.size();
+        ptrdiff_t out_shift = static_cast<ptrdiff_t>(new_output.size()) -
+                              static_cast<ptrdiff_t>(out_end - out_begin);
+        for (size_t u = last_unit; u < units.size(); u++) {
+            units[u].row += shift;
+            units[u].line += out_shift;
         }
-        block.clear();
+        units.erase(units.begin() + first_unit, units.begin() + last_unit);
+        units.insert(units.begin() + first_unit, new_units.begin(), new_units.end());
+
+        // Trim output lines that came out the same.
+        size_t head = 0, tail = 0;
+        size_t old_size = out_end - out_begin, new_size = new_output.size();
+        while (head < min(old_size, new_size) &&
+               output[out_begin + head] == new_output[head])
+            ++head;
+        while (tail < min(old_size, new_size) - head &&
+               output[out_end - 1 - tail] == new_output[new_size - 1 - tail])
+            ++tail;
+        vector<string> changed(new_output.begin() + head, new_output.end() - tail);
+        auto at = output.begin() + out_begin + head;
+        output.erase(at, at + (old_size - head - tail));
+        output.insert(output.begin() + out_begin + head, changed.begin(), changed.end());
+        return {out_begin + head, old_size - head - tail, move(changed)};
+    }
+
+    // Lexes row i from state, leaving state at the start of the next row.
+    void lex_row(size_t i, LexState &state) {
+        string_view line = rows.line[i];
+        rows.state[i] = state;
+        rows.tokens[i].clear();
+        tokenize_line(line, state, rows.tokens[i]);
+        rows.verbatim[i] = rows.state[i].in_string() || state.in_string();
+        size_t pos = line.find_first_not_of(" \t");
+        rows.indent_size[i] = pos == string::npos ? line.size() : pos;
+        uint64_t signature = pattern_signature_seed;
+        rows.pattern[i].clear();
+        bool verbatim = rows.verbatim[i];
+        for (const Token &tok : rows.tokens[i]) {
+            uint32_t id = verbatim ? 0 : symbols->intern(tok.text(line), tok.kind);
+            rows.pattern[i].push_back(id);
+            signature = pattern_signature_step(signature, id);
+        }
+        rows.signature[i] = signature;
+    }
+
+    bool add_fmt_tag;
+    Arena keys; // Interned symbol texts, kept until set_text.
+    EditableTable rows;
+    LexState end_state; // Lexer state after the last row.
+    vector<Unit> units;
+    vector<string> output;
+};
+
+// A reformat_stream source over a Python iterable of lines. One trailing '\n'
+// is dropped from each, so file objects can be passed as they are.
+struct PyLineSource {
+    py::iterator it;
+    string current;
+
+    bool next(string_view &line) {
+        if (it == py::iterator::sentinel()) return false;
+        current = it->cast<string>();
+        ++it;
+        if (!current.empty() && current.back() == '\n') current.pop_back();
+        line = current;
+        return true;
     }
 };
 
+// A reformat_stream sink that passes batches of lines to a Python callable,
+// such as the write method of a file.
+struct PyLineSink {
+    py::function write;
+    string buffer;
+
+    void write_line(string_view line) {
+        buffer.append(line).push_back('\n');
+        if (buffer.size() >= 1 << 16) flush();
+    }
+    void flush() {
+        if (!buffer.empty()) write(py::str(buffer));
+        buffer.clear();
+    }
+};
+
+// One column of a TokenBuffer, exposed to Python through the buffer protocol.
+// Holds a reference to the whole result so the data outlives any memoryview.
+template <typename T> struct TokenColumn {
+    shared_ptr<TokenBuffer> owner;
+    const vector<T> *data;
+};
+
+template <typename T> void bind_token_column(py::module_ &m, const char *name) {
+    py::class_<TokenColumn<T>>(m, name, py::buffer_protocol())
+        .def_buffer([](TokenColumn<T> &col) {
+            return py::buffer_info(const_cast<T *>(col.data->data()), sizeof(T),
+                                   py::format_descriptor<T>::format(), 1,
+                                   {col.data->size()}, {sizeof(T)}, true);
+        })
+        .def("__len__", [](const TokenColumn<T> &col) { return col.data->size(); });
+}
+
+template <typename T>
+auto token_column(const vector<T> TokenBuffer::*field) {
+    return [field](shared_ptr<TokenBuffer> self) {
+        return TokenColumn<T>{self, &(*self.*field)};
+    };
+}
+
 PYBIND11_MODULE(_token_column_format, m) {
     m.doc() = "A module that wraps PythonLineTokenizer using pybind11";
     py::class_<PythonLineTokenizer>(m, "PythonLineTokenizer")
-        .def(py::init<>())
+        .def(py::init<int>(), py::arg("num_threads") = 1,
+             "Create a tokenizer that lexes large documents on num_threads "
+             "threads (0 for one per core).")
+        .def_property_readonly("num_threads", &PythonLineTokenizer::num_threads)
         .def("format_tokens", &PythonLineTokenizer::format_tokens,
              "Format tokens by prepending delimiters based on Black-like "
              "spacing heuristics")
@@ -217,19 +969,165 @@ PYBIND11_MODULE(_token_column_format, m) {
             "formatted.")
         .def("reformat_buffer", &PythonLineTokenizer::reformat_buffer, py::arg("code"),
              py::arg("add_fmt_tag") = false, py::arg("debug") = false,
+             py::call_guard<py::gil_scoped_release>(),
              "Reformat a code buffer, grouping lines with matching token "
              "patterns and indentation into blocks and aligning them into evn "
              "columns.")
         .def("reformat_lines", &PythonLineTokenizer::reformat_lines, py::arg("lines"),
              py::arg("add_fmt_tag") = false, py::arg("debug") = false,
+             py::call_guard<py::gil_scoped_release>(),
              "Reformat a code buffer (given as a vector of lines) by grouping "
              "lines with matching token patterns and indentation into blocks "
-             "and  inorkeywords.begin(), keywords.end(), <stcolumns.");
+             "and  inorkeywords.begin(), keywords.end(), <stcolumns.")
+        .def(
+            "reformat_stream",
+            [](PythonLineTokenizer &self, py::iterable lines, py::function write,
+               bool add_fmt_tag, size_t max_block_lines) {
+                PyLineSource source{py::iter(lines), {}};
+                PyLineSink sink{write, {}};
+                size_t written =
+                    self.reformat_stream(source, sink, add_fmt_tag, max_block_lines);
+                sink.flush();
+                return written;
+            },
+            py::arg("lines"), py::arg("write"), py::arg("add_fmt_tag") = false,
+            py::arg("max_block_lines") = 1 << 14,
+            "Reformat an iterable of lines (such as an open file), passing the "
+            "output to write as each block is finished. Memory stays bounded; "
+            "blocks longer than max_block_lines are split. Returns the number of "
+            "lines written.")
+        .def(
+            "reformat_fd",
+            [](PythonLineTokenizer &self, int in_fd, int out_fd, bool add_fmt_tag,
+               size_t max_block_lines) {
+                FdLineReader source(in_fd);
+                FdLineWriter sink(out_fd);
+                size_t written =
+                    self.reformat_stream(source, sink, add_fmt_tag, max_block_lines);
+                sink.flush();
+                return written;
+            },
+            py::arg("in_fd"), py::arg("out_fd"), py::arg("add_fmt_tag") = false,
+            py::arg("max_block_lines") = 1 << 14,
+            py::call_guard<py::gil_scoped_release>(),
+            "Reformat from one file descriptor to another in bounded memory, without "
+            "holding the GIL. Returns the number of lines written.")
+        .def("check_buffer", &PythonLineTokenizer::check_buffer, py::arg("code"),
+             py::arg("add_fmt_tag") = false, py::call_guard<py::gil_scoped_release>(),
+             "Return the index of the first line reformat_buffer would change, or "
+             "None if the code is already formatted. Stops at the first difference "
+             "without building the output.")
+        .def("reformat_ranges", &PythonLineTokenizer::reformat_ranges, py::arg("code"),
+             py::arg("ranges"), py::arg("add_fmt_tag") = false,
+             py::call_guard<py::gil_scoped_release>(),
+             "Reformat only the lines in ranges, a list of (begin, end) line indices "
+             "from 0 with end excluded, copying all other lines unchanged. Blocks that "
+             "overlap a range are formatted whole.");
+
+    py::class_<IncrementalFormatter>(m, "IncrementalFormatter")
+        .def(py::init<bool>(), py::arg("add_fmt_tag") = false,
+             "Create a formatter for a document that is edited line by line.")
+        .def("set_text", &IncrementalFormatter::set_text, py::arg("code"),
+             "Replace the whole document and format it from scratch.")
+        .def("edit", &IncrementalFormatter::edit, py::arg("start"), py::arg("removed"),
+             py::arg("lines"),
+             "Replace `removed` source lines from line `start` with `lines`. Returns "
+             "(start, removed, lines): the range of formatted lines that changed and "
+             "their replacement.")
+        .def_property_readonly("num_lines", &IncrementalFormatter::num_lines,
+                               "Number of source lines in the document")
+        .def("lines", &IncrementalFormatter::lines, "The formatted document as lines")
+        .def("text", &IncrementalFormatter::text, "The formatted document");
+
+    py::enum_<TokenKind>(m, "TokenKind")
+        .value("Identifier", TokenKind::Identifier)
+        .value("Keyword", TokenKind::Keyword)
+        .value("String", TokenKind::String)
+        .value("Number", TokenKind::Number)
+        .value("Comment", TokenKind::Comment)
+        .value("Other", TokenKind::Other)
+        .value("Plus", TokenKind::Plus)
+        .value("Minus", TokenKind::Minus)
+        .value("Star", TokenKind::Star)
+        .value("DoubleStar", TokenKind::DoubleStar)
+        .value("Slash", TokenKind::Slash)
+        .value("DoubleSlash", TokenKind::DoubleSlash)
+        .value("Percent", TokenKind::Percent)
+        .value("At", TokenKind::At)
+        .value("LeftShift", TokenKind::LeftShift)
+        .value("RightShift", TokenKind::RightShift)
+        .value("Amper", TokenKind::Amper)
+        .value("Vbar", TokenKind::Vbar)
+        .value("Circumflex", TokenKind::Circumflex)
+        .value("Tilde", TokenKind::Tilde)
+        .value("ColonEqual", TokenKind::ColonEqual)
+        .value("Less", TokenKind::Less)
+        .value("Greater", TokenKind::Greater)
+        .value("LessEqual", TokenKind::LessEqual)
+        .value("GreaterEqual", TokenKind::GreaterEqual)
+        .value("EqEqual", TokenKind::EqEqual)
+        .value("NotEqual", TokenKind::NotEqual)
+        .value("LPar", TokenKind::LPar)
+        .value("RPar", TokenKind::RPar)
+        .value("LSqb", TokenKind::LSqb)
+        .value("RSqb", TokenKind::RSqb)
+        .value("LBrace", TokenKind::LBrace)
+        .value("RBrace", TokenKind::RBrace)
+        .value("Comma", TokenKind::Comma)
+        .value("Colon", TokenKind::Colon)
+        .value("Dot", TokenKind::Dot)
+        .value("Semi", TokenKind::Semi)
+        .value("Equal", TokenKind::Equal)
+        .value("RArrow", TokenKind::RArrow)
+        .value("Ellipsis", TokenKind::Ellipsis)
+        .value("Exclamation", TokenKind::Exclamation)
+        .value("PlusEqual", TokenKind::PlusEqual)
+        .value("MinusEqual", TokenKind::MinusEqual)
+        .value("StarEqual", TokenKind::StarEqual)
+        .value("SlashEqual", TokenKind::SlashEqual)
+        .value("DoubleSlashEqual", TokenKind::DoubleSlashEqual)
+        .value("PercentEqual", TokenKind::PercentEqual)
+        .value("AtEqual", TokenKind::AtEqual)
+        .value("AmperEqual", TokenKind::AmperEqual)
+        .value("VbarEqual", TokenKind::VbarEqual)
+        .value("CircumflexEqual", TokenKind::CircumflexEqual)
+        .value("RightShiftEqual", TokenKind::RightShiftEqual)
+        .value("LeftShiftEqual", TokenKind::LeftShiftEqual)
+        .value("DoubleStarEqual", TokenKind::DoubleStarEqual);
+
+    bind_token_column<uint64_t>(m, "UInt64Column");
+    bind_token_column<uint32_t>(m, "UInt32Column");
+    bind_token_column<uint8_t>(m, "UInt8Column");
+    py::class_<TokenBuffer, shared_ptr<TokenBuffer>>(m, "TokenBuffer")
+        .def("__len__", &TokenBuffer::size)
+        .def_property_readonly("start", token_column(&TokenBuffer::start),
+                               "Byte offset of each token from the start of the buffer")
+        .def_property_readonly("length", token_column(&TokenBuffer::length),
+                               "Byte length of each token")
+        .def_property_readonly("kind", token_column(&TokenBuffer::kind),
+                               "TokenKind of each token, as an integer")
+        .def_property_readonly("line", token_column(&TokenBuffer::line),
+                               "Zero-based line number of each token");
 
+    m.def(
+        "tokenize_buffer",
+        [](py::bytes code) {
+            string_view view(code);
+            py::gil_scoped_release release;
+            return make_shared<TokenBuffer>(tokenize_buffer(view));
+        },
+        py::arg("code"),
+        "Tokenize a whole buffer of Python code (UTF-8 bytes) without holding the "
+        "GIL. Returns a TokenBuffer whose start, length, kind and line columns "
+        "support the buffer protocol.");
     m.def("tokenize", &tokenize, "Tokenize a single line of Python code");
     m.def("tokens_match", &tokens_match,
           "Compare two token vectors using wildcards for identifiers, "
           "strings, and numerics");
-    m.def("is_oneline_statement", &is_oneline_statement, py::arg("tokens"),
+    m.def("is_keyword", &is_keyword, py::arg("token"),
+          "Check if a token is a Python keyword");
+    m.def("is_soft_keyword", &is_soft_keyword, py::arg("token"),
+          "Check if a token is a Python soft keyword (match, case, type, _)");
+    m.def("is_oneline_statement", &is_oneline_statement<string>, py::arg("tokens"),
           "Check if a line is an oneline statement");
 }
@@ -0,0 +1,84 @@
+// _unicode.hpp
+// UTF-8 decoding and Unicode character properties for the tokenizer. Lines
+// are scanned as bytes; these are only consulted at bytes >= 0x80, so ASCII
+// text never pays for them.
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+
+#include "_unicode_tables.hpp"
+
+// Decodes the code point starting at s[i] and stores its byte length in len.
+// Malformed sequences (truncated, overlong, surrogates, out of range) decode
+// to U+FFFD with len 1, so the caller steps over exactly one bad byte.
+inline char32_t utf8_decode(std::string_view s, size_t i, size_t &len) {
+    auto byte = [&](size_t k) { return static_cast<unsigned char>(s[k]); };
+    unsigned char lead = byte(i);
+    len = 1;
+    if (lead < 0x80) return lead;
+    size_t n = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 0;
+    if (n == 0 || lead > 0xF4 || i + n > s.size()) return 0xFFFD;
+    char32_t cp = lead & (0x7F >> n);
+    for (size_t k = 1; k < n; ++k) {
+        if ((byte(i + k) & 0xC0) != 0x80) return 0xFFFD;
+        cp = cp << 6 | (byte(i + k) & 0x3F);
+    }
+    constexpr char32_t min_cp[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (cp < min_cp[n] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return 0xFFFD;
+    len = n;
+    return cp;
+}
+
+template <size_t N>
+bool in_ranges(const CodepointRange (&ranges)[N], char32_t cp) {
+    auto before = [](char32_t c, const CodepointRange &r) { return c < r.first; };
+    auto it = std::upper_bound(std::begin(ranges), std::end(ranges), cp, before);
+    return it != std::begin(ranges) && cp <= std::prev(it)->last;
+}
+
+// Python identifier classes (PEP 3131): XID_Start plus '_', and XID_Continue.
+inline bool is_xid_start(char32_t cp) {
+    if (cp < 0x80)
+        return (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z') || cp == '_';
+    return in_ranges(xid_start_ranges, cp);
+}
+
+inline bool is_xid_continue(char32_t cp) {
+    if (cp < 0x80) return is_xid_start(cp) || (cp >= '0' && cp <= '9');
+    return in_ranges(xid_continue_ranges, cp);
+}
+
+// Number of terminal columns a code point occupies: 0, 1 or 2. Control
+// characters count as one, as they do in ASCII text.
+inline int codepoint_width(char32_t cp) {
+    if (cp < 0x300) return 1;
+    if (in_ranges(zero_width_ranges, cp)) return 0;
+    return in_ranges(wide_ranges, cp) ? 2 : 1;
+}
+
+// True if s has no bytes >= 0x80, tested eight bytes at a time.
+inline bool is_ascii(std::string_view s) {
+    uint64_t high = 0;
+    size_t i = 0;
+    for (; i + 8 <= s.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, s.data() + i, 8);
+        high |= word;
+    }
+    for (; i < s.size(); ++i) high |= static_cast<unsigned char>(s[i]);
+    return (high & 0x8080808080808080) == 0;
+}
+
+// Display width of UTF-8 text in terminal columns. Malformed bytes count as
+// one column each.
+inline size_t display_width(std::string_view s) {
+    if (is_ascii(s)) return s.size();
+    size_t width = 0, len;
+    for (size_t i = 0; i < s.size(); i += len)
+        width += codepoint_width(utf8_decode(s, i, len));
+    return width;
+}
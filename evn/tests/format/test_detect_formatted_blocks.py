@@ -148,5 +148,25 @@ def test_multiline_is_ignored(ifb):
     #             fmt: on
 """
 
+def test_mark_formtted_ranges(ifb):
+    # Blocks are only marked around the given lines; the rest is unmarked.
+    code = 'a = 1\nb = 2\nfoo(bar)\nxyz\nc = 3\nd = 4\n'
+    full = ifb.mark_formtted_blocks(code, threshold=2)
+    assert ifb.mark_formtted_ranges(code, [(0, 6)], threshold=2) == full
+    assert ifb.mark_formtted_ranges(code, [], threshold=2) == code
+    marked = ifb.mark_formtted_ranges(code, [(5, 6)], threshold=2)
+    assert marked.startswith('a = 1\nb = 2\n')
+    assert marked.endswith(full[full.index('xyz'):])
+
+def test_similarity_score_matrix(ifb):
+    # Scores come from a quantized matrix; they agree with float sums to ~1e-3.
+    score = ifb.compute_similarity_score('a = 1', 'a = 1')
+    assert score == pytest.approx(4.6827, abs=1e-3)
+    assert ifb.compute_similarity_score('ab', 'xy') == pytest.approx(0.3)
+    group = evn.format.CharGroup.EQUAL
+    ifb.set_substitution_matrix(group, group, 20)
+    rescored = ifb.compute_similarity_score('a = 1', 'a = 1')
+    assert rescored - score == pytest.approx(3.1305, abs=1e-3)
+
 if __name__ == "__main__":
     main()
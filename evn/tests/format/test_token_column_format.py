@@ -63,6 +63,56 @@ def test_tokenize_multi_char_operators(tokenizer):
     expected = ["a", "**", "b", "//", "c", "!=", "d", "->", "e"]
     assert tokens == expected
 
+def test_tokenize_augmented_operators(tokenizer):
+    code_line = "a **= b //= c >>= d <<= e @= f != g"
+    tokens = evn.tokenize(code_line)
+    expected = ["a", "**=", "b", "//=", "c", ">>=", "d", "<<=", "e", "@=", "f", "!=", "g"]
+    assert tokens == expected
+
+def test_tokenize_walrus(tokenizer):
+    code_line = "if (n:=len(a)) > 10: pass"
+    tokens = evn.tokenize(code_line)
+    expected = ["if", "(", "n", ":=", "len", "(", "a", ")", ")", ">", "10", ":", "pass"]
+    assert tokens == expected
+    assert tokenizer.join_tokens(tokens) == "if (n := len(a)) > 10: pass"
+
+def test_tokenize_longest_operator_match(tokenizer):
+    assert evn.tokenize("x[...]") == ["x", "[", "...", "]"]
+    assert evn.tokenize("a..b") == ["a", ".", ".", "b"]
+    assert evn.tokenize("f(*args, **kw)") == ["f", "(", "*", "args", ",", "**", "kw", ")"]
+
+def test_tokenize_numbers():
+    code_line = "x = 0x1F + 0o17 + 0b_1010 + 1_000_000 + 3j + 1.5e-3 + 1E+10J + .5 + 1."
+    expected = [
+        "x", "=", "0x1F", "+", "0o17", "+", "0b_1010", "+", "1_000_000", "+", "3j", "+", "1.5e-3", "+",
+        "1E+10J", "+", ".5", "+", "1."
+    ]
+    assert evn.tokenize(code_line) == expected
+    assert evn.tokenize("a[1:-1] = 1-2") == ["a", "[", "1", ":", "-", "1", "]", "=", "1", "-", "2"]
+    # Malformed tails end the literal.
+    assert evn.tokenize("0x 1_ 1e 1..2") == ["0", "x", "1", "_", "1", "e", "1.", ".2"]
+
+def test_tokenize_unicode_identifiers(tokenizer):
+    assert evn.tokenize("Δt = α*2") == ["Δt", "=", "α", "*", "2"]
+    assert evn.tokenize("naïve_ß, 中文") == ["naïve_ß", ",", "中文"]
+    # Characters that cannot be part of an identifier are single tokens.
+    assert evn.tokenize("x→y") == ["x", "→", "y"]
+    assert tokenizer.join_tokens(["Δt", "=", "α", "*", "2"]) == "Δt = α * 2"
+    assert evn.tokens_match(evn.tokenize("α = 1"), evn.tokenize("x = 2"))
+
+def test_benchmark_tokenize_numeric_table(benchmark):
+    row = "    (1048576, 0.318310, -2.718e+05, 0xDEADBEEF, 1_000_001, 42j),\n"
+    code = "TABLE = [\n" + row * 2000 + "]\n"
+    output = benchmark(evn.PythonLineTokenizer().reformat_buffer, code)
+    assert output.count("\n") == 2002
+
+def test_benchmark_tokenize_dense_lines(benchmark):
+    # Lexer throughput on long dense lines, without formatting or Python objects.
+    row = "    (1048576, 0.318310, -2.718e+05, 0xDEADBEEF, 'key', name_1 + other[2]),\n"
+    code = ("TABLE = [\n" + row * 2000 + "]\n").encode()
+    toks = benchmark(evn.tokenize_buffer, code)
+    assert len(toks) == 3 + 20 * 2000 + 1
+
 def test_tokenize_while(tokenizer):
     code_line = "while if this is True: break out # comment"
     tokens = evn.tokenize(code_line)
@@ -72,6 +122,30 @@ def test_tokenize_while(tokenizer):
     assert evn.is_oneline_statement(tokens[:-2])
     assert evn.is_oneline_statement(tokens)
 
+def test_keyword_classification():
+    for kw in ['False', 'None', 'and', 'continue', 'nonlocal', 'yield', 'lambda']:
+        assert evn.is_keyword(kw)
+        assert not evn.is_soft_keyword(kw)
+    for soft in ['match', 'case', 'type', '_']:
+        assert evn.is_soft_keyword(soft)
+        assert not evn.is_keyword(soft)
+    for ident in ['', 'x', 'false', 'yields', 'els', '__', 'Match']:
+        assert not evn.is_keyword(ident)
+        assert not evn.is_soft_keyword(ident)
+
+def test_tokenize_buffer():
+    code = b"x = '''a\nb'''\nif y: f(1)  # c\n"
+    toks = evn.tokenize_buffer(code)
+    assert len(toks) == 12
+    start, length = memoryview(toks.start), memoryview(toks.length)
+    text = [code[s:s + n].decode() for s, n in zip(start, length)]
+    assert text == ["x", "=", "'''a", "b'''", "if", "y", ":", "f", "(", "1", ")", "# c"]
+    assert list(memoryview(toks.line)) == [0, 0, 0, 1] + [2] * 8
+    kinds = [evn.TokenKind(k) for k in memoryview(toks.kind)]
+    assert kinds[:4] == [evn.TokenKind.Identifier, evn.TokenKind.Equal, evn.TokenKind.String, evn.TokenKind.String]
+    assert kinds[4] == evn.TokenKind.Keyword
+    assert kinds[-1] == evn.TokenKind.Comment
+
 # --- Join Tokens (Black-like formatting) Tests ---
 
 def test_join_tokens_default_black_formatting(tokenizer):
@@ -120,6 +194,12 @@ def test_join_tokens_mixed_syntax(tokenizer):
     expected = "def add(a, b): return a + b"
     assert joined == expected
 
+def test_join_tokens_justified(tokenizer):
+    # Widths count the delimiter; padding goes around delimiter and token.
+    tokens = ["x", "=", "1", "#c"]
+    joined = tokenizer.join_tokens(tokens, [3, 4, 5, 0], ['L', 'R', 'C', 'L'])
+    assert joined == "x     =  1   #c"
+
 # --- Token Matching Tests ---
 
 def test_tokens_match_wildcards(tokenizer):
@@ -255,6 +335,12 @@ def test_reformat_lines_with_empty_lines(tokenizer):
     assert output[1] == ""
     assert output[3] == ""
 
+def test_reformat_buffer_tokenless_lines(tokenizer):
+    # Lines of only \r, \f or \v have no tokens; blocks of them stay blank.
+    assert tokenizer.reformat_buffer("\r\n\r\n") == "\n\n"
+    assert tokenizer.reformat_buffer("a\r\n\r\n\r\nb") == "a\n\n\nb\n"
+    assert tokenizer.reformat_buffer("\f\n\f\n") == "\n\n"
+
 def test_reformat_lines_with_mixed_indentation(tokenizer):
     # Ensure mixed indentation is preserved.
     lines = ["x=10", "    y=20", "z=30", "    ", "  a=1"]
@@ -263,3 +349,159 @@ def test_reformat_lines_with_mixed_indentation(tokenizer):
     assert output[3] == ""
     assert output[4] == "  a=1"
 
+
+def test_reformat_lines_skips_docstrings(tokenizer):
+    # Lines inside a multi-line string are left untouched and end any block.
+    lines = ['def f():', '    """Columns:', '    a=1', '    bb=22', '    """', '    a=1', '    bb=22']
+    expected = [
+        'def f():',
+        '    """Columns:',
+        '    a=1',
+        '    bb=22',
+        '    """',
+        '    #             fmt: off',
+        '    a  = 1',
+        '    bb = 22',
+        '    #             fmt: on',
+    ]
+    helper_test_reformat_lines(tokenizer, lines, expected)
+
+def test_reformat_lines_string_continuations(tokenizer):
+    # Triple-quoted strings and backslash-continued strings span lines.
+    lines = ["x = '''abc", "if a: b", "'''", "y = 'a\\", "b=1'", "c=2"]
+    helper_test_reformat_lines(tokenizer, lines, lines)
+
+def test_reformat_lines_display_width(tokenizer):
+    # Wide characters take two columns and combining marks none.
+    lines = ["x = ['データ', 1]", "y = ['abc', 22]", "z = ['e\u0301', 3]"]
+    expected = [
+        '#             fmt: off',
+        "x = ['データ', 1 ]",
+        "y = ['abc'   , 22]",
+        "z = ['e\u0301'     , 3 ]",
+        '#             fmt: on',
+    ]
+    helper_test_reformat_lines(tokenizer, lines, expected)
+    assert tokenizer.join_tokens(["'中'", ","], [5, 1], ['L', 'L'], True) == "'中' ,"
+
+def test_reformat_reuses_tokenizer(tokenizer):
+    # Per-document state is released between calls; earlier results stay valid.
+    small = 'a = 1\nbb = 22\n'
+    large = ''.join(f'x{i} = {i}\ny{i}{i} = [{i}]\n\n' for i in range(500))
+    first = tokenizer.reformat_buffer(small)
+    assert first == 'a  = 1\nbb = 22\n'
+    expected = evn.PythonLineTokenizer().reformat_buffer(large)
+    assert tokenizer.reformat_buffer(large) == expected
+    assert tokenizer.reformat_buffer(small) == first
+    assert tokenizer.reformat_lines(['a = 1', 'bb = 22']) == ['a  = 1', 'bb = 22']
+
+def test_reformat_buffer_threads():
+    # Chunks are lexed in parallel; strings and brackets spanning a chunk
+    # boundary must come out the same as with one thread.
+    parts = []
+    for i in range(3000):
+        parts.append(f'a{i} = f({i})\nbb{i} = g({i}, {i})\n')
+        if i % 300 == 0: parts.append('s = """\n' + 'x = 1\n' * 2500 + '"""\n')
+        if i % 700 == 0: parts.append('T = [\n' + '    (1, "a"),\n' * 3000 + ']\n')
+    code = ''.join(parts)
+    threaded = evn.PythonLineTokenizer(num_threads=4)
+    assert threaded.num_threads == 4
+    assert threaded.reformat_buffer(code, add_fmt_tag=True) == evn.PythonLineTokenizer().reformat_buffer(code, add_fmt_tag=True)
+
+def test_reformat_buffer_parts():
+    # Large documents are cut into parts after blank lines and formatted in
+    # parallel; blocks and tags must not change at the cuts.
+    parts = []
+    for i in range(12000):
+        parts.append(f'v{i % 13} = h({i}, "{i % 7}")  \n')
+        if i % 997 == 0: parts.append('\n' if i % 2 else '   \n\n')
+    code = ''.join(parts) + 'tail = 1'
+    threaded = evn.PythonLineTokenizer(num_threads=4)
+    for add_fmt_tag in (False, True):
+        assert threaded.reformat_buffer(code, add_fmt_tag=add_fmt_tag) == evn.PythonLineTokenizer().reformat_buffer(code, add_fmt_tag=add_fmt_tag)
+
+def test_incremental_formatter():
+    # Each edit must leave the same output as formatting the edited document
+    # from scratch, and the returned replacement must turn the old output into
+    # the new one.
+    import random
+    rng = random.Random(0)
+    source = [f'x{i} = f({i}, {i * 7})' if i % 9 else '' for i in range(200)]
+    snippets = ['a = 1', 'bbb = 22', '', '"""', 's = """doc', 'def f(a, b):',
+                '    return a + b', 'if x: y = 1', '# note', "t = 'open\\"]
+    for add_fmt_tag in (False, True):
+        lines = list(source)
+        formatter = evn.IncrementalFormatter(add_fmt_tag=add_fmt_tag)
+        formatter.set_text('\n'.join(lines) + '\n')
+        full = evn.PythonLineTokenizer()
+        output = formatter.lines()
+        assert output == full.reformat_lines(lines, add_fmt_tag=add_fmt_tag)
+        for _ in range(150):
+            start = rng.randrange(len(lines) + 1)
+            removed = rng.randrange(min(3, len(lines) - start) + 1)
+            inserted = rng.choices(snippets + lines, k=rng.randrange(3))
+            first, count, replacement = formatter.edit(start, removed, inserted)
+            lines[start:start + removed] = inserted
+            output[first:first + count] = replacement
+            expected = full.reformat_lines(lines, add_fmt_tag=add_fmt_tag)
+            assert formatter.lines() == expected
+            assert output == expected
+            assert formatter.num_lines == len(lines)
+    with pytest.raises(IndexError):
+        formatter.edit(len(lines) + 1, 0, [])
+
+def test_reformat_stream(tokenizer, tmp_path):
+    # Streaming gives the same output as reformat_buffer, from a file object or
+    # a file descriptor, as long as no block is longer than max_block_lines.
+    import io
+    parts = [f'a{i} = f({i})\nbb{i} = g({i}, {i})\n\n' for i in range(20000)]
+    parts.insert(5000, 's = """\n' + 'x = 1\n' * 1000 + '"""\n')
+    code = ''.join(parts) + 'last = 1'
+    expected = tokenizer.reformat_buffer(code, add_fmt_tag=True)
+    chunks = []
+    count = tokenizer.reformat_stream(io.StringIO(code), chunks.append, add_fmt_tag=True)
+    assert ''.join(chunks) == expected
+    assert count == expected.count('\n')
+    src, dst = tmp_path / 'in.py', tmp_path / 'out.py'
+    src.write_text(code)
+    with open(src) as fin, open(dst, 'w') as fout:
+        tokenizer.reformat_fd(fin.fileno(), fout.fileno(), add_fmt_tag=True)
+    assert dst.read_text() == expected
+    # Longer blocks are split.
+    chunks = []
+    tokenizer.reformat_stream(['a = 1', 'bbb = 2', 'cc = 3'], chunks.append,
+                              max_block_lines=2)
+    assert ''.join(chunks) == 'a   = 1\nbbb = 2\ncc = 3\n'
+
+def test_reformat_delimiters_cached_by_shape(tokenizer):
+    # Delimiters are cached by token kinds across blocks and documents; def
+    # and class lines have the same kinds but space keyword arguments apart.
+    defs = 'def f(a=1): pass\ndef g(b=2): pass\n'
+    classes = 'class C(a=1): pass\nclass D(b=2): pass\n'
+    for _ in range(2):
+        assert tokenizer.reformat_buffer(defs) == defs
+        assert tokenizer.reformat_buffer(classes) == 'class C(a = 1): pass\nclass D(b = 2): pass\n'
+    table = ''.join(f'row{i} = ({i}, "{i * 7}", {i % 5})\n' for i in range(3000))
+    assert tokenizer.reformat_buffer(table) == evn.PythonLineTokenizer().reformat_buffer(table)
+
+def test_reformat_ranges(tokenizer):
+    # Only blocks that overlap a range are formatted; everything else,
+    # including blocks elsewhere, is copied through as it is.
+    code = 'a = 1\nbbb = 2\n\nx = f(1)\nyy = f(22)\n\ns = """\nq = 1\n"""\nc = 3\ndd = 4\n'
+    assert tokenizer.reformat_ranges(code, [(0, len(code.splitlines()))]) == tokenizer.reformat_buffer(code)
+    assert tokenizer.reformat_ranges(code, []) == code
+    assert tokenizer.reformat_ranges(code, [(4, 5)]) == code.replace('x = f(1)', 'x  = f(1 )')
+    assert tokenizer.reformat_ranges(code, [(7, 8), (10, 99)]) == code.replace('c = 3', 'c  = 3')
+    assert tokenizer.reformat_ranges(code, [(9, 10)], add_fmt_tag=True) == code.replace(
+        'c = 3\ndd = 4\n', '#             fmt: off\nc  = 3\ndd = 4\n#             fmt: on\n')
+
+def test_check_buffer(tokenizer):
+    # check_buffer gives the first line reformat_buffer would change, or None.
+    code = 'x = [1,2]\n\na = 1\nbb = 2\n'
+    assert tokenizer.check_buffer(code) == 2
+    fixed = tokenizer.reformat_buffer(code)
+    assert tokenizer.check_buffer(fixed) is None
+    assert tokenizer.check_buffer(fixed.rstrip('\n')) == 3
+    assert tokenizer.check_buffer('') is None
+    assert tokenizer.check_buffer('x = 1  \n') == 0
+    assert tokenizer.check_buffer('x = 1\n', add_fmt_tag=True) is None